@@ -0,0 +1,14 @@
+#pragma once
+
+// The benchmarks of calc-bench, one function per compiler phase or feature.
+
+class BenchHarness;
+
+void benchTraversal(BenchHarness &h);
+void benchLexer(BenchHarness &h);
+void benchParser(BenchHarness &h);
+void benchCompile(BenchHarness &h);
+void benchServer(BenchHarness &h);
+void benchPhases(BenchHarness &h);
+void benchEmbed(BenchHarness &h);
+void benchFused(BenchHarness &h);
@@ -0,0 +1,42 @@
+// Compiling a file of formulas to object files with calc -f -j N,
+// from one thread up to one per hardware thread, to see how the parallel compilation scales.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "workloads.h"
+#include "file_compiler.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Threading.h"
+#include <string>
+
+void benchCompile(BenchHarness &h) {
+    if (!h.isEnabled("compile/"))
+        return;
+    const unsigned num_formulas = 2048;
+    std::string input = formulaFile(num_formulas);
+
+    llvm::SmallString<128> dir;
+    if (llvm::sys::fs::createUniqueDirectory("calc-bench", dir))
+        return;
+
+    FileCompiler::Options opts;
+    opts.output_kind = FileCompiler::Object;
+    opts.output = (dir + "/formulas.o").str();
+    opts.opt_level = 2;
+    opts.chunk_size = 64;
+
+    unsigned max_threads = llvm::hardware_concurrency().compute_thread_count();
+    for (unsigned threads = 1;; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+        opts.threads = threads;
+        h.run("compile/j" + std::to_string(threads), num_formulas, input.size(), [&] {
+            doNotOptimize(FileCompiler(opts).compile(input, "formulas"));
+        });
+        if (threads == max_threads)
+            break;
+    }
+
+    llvm::sys::fs::remove_directories(dir);
+}
@@ -0,0 +1,48 @@
+// Evaluating an expression through the embedding API (see libcalc.h): compiled once,
+// then called directly, from one thread or from several threads sharing the same handle.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "libcalc.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+void benchEmbed(BenchHarness &h) {
+    if (!h.isEnabled("embed/"))
+        return;
+    llvm::ExitOnError exit_on_err("calc-bench: ");
+    auto compiler = exit_on_err(ExprCompiler::create(2));
+
+    unsigned n = 0;
+    h.runLatency("embed/compile", 200, [&] {
+        doNotOptimize(exit_on_err(compiler->compile("with a,b: a*b+" + std::to_string(n++))));
+    });
+
+    CompiledExpr expr = exit_on_err(compiler->compile("with a,b,c: (a+b)*c - a/b"));
+    const uint64_t evals = 1 << 16;
+    auto evaluate = [&expr, evals](int32_t seed) {
+        int32_t vars[3] = {seed, 7, 3};
+        int32_t sum = 0;
+        for (uint64_t i = 0; i != evals; ++i) {
+            vars[0] = int32_t(i);
+            sum += expr.evaluate(vars);
+        }
+        return sum;
+    };
+    h.run("embed/evaluate", evals, 0, [&] {
+        doNotOptimize(evaluate(1));
+    });
+
+    // the threads evaluate the same handle, nothing is shared but the code
+    const unsigned threads = 4;
+    h.run("embed/evaluate-4-threads", threads * evals, 0, [&] {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t != threads; ++t)
+            workers.emplace_back([&, t] { doNotOptimize(evaluate(int32_t(t))); });
+        for (std::thread &w : workers)
+            w.join();
+    });
+}
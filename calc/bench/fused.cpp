@@ -0,0 +1,122 @@
+// A group of formulas over the same columns, evaluated by one batch kernel each
+// or by one fused kernel (see CodeGen::compileFused()), which reads each column once per row.
+// The columns are larger than the caches, so the kernels are bound by the memory bandwidth.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "ast.h"
+#include "code_gen.h"
+#include "const_fold.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "sema.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// 8 formulas over 4 columns, most of them share price*qty
+const char *const formulas[] = {
+    "with price, qty: price*qty",
+    "with price, qty, cost: price*qty - cost*qty",
+    "with price, qty, tax: price*qty + price*qty*tax/100",
+    "with qty, cost: cost*qty",
+    "with price, cost: price - cost",
+    "with price, qty, cost, tax: (price*qty - cost*qty)*(100-tax)/100",
+    "with qty, tax: qty*tax",
+    "with price, qty, cost: (price*qty - cost*qty)/qty",
+};
+const size_t NumFormulas = sizeof(formulas) / sizeof(formulas[0]);
+const char *const columns[] = {"price", "qty", "cost", "tax"};
+const size_t NumColumns = 4;
+const size_t NumRows = 1 << 22;
+
+using BatchFn = void (*)(const int32_t *const *cols, int32_t *out, size_t n);
+using FusedFn = void (*)(const int32_t *const *cols, int32_t *const *outs, size_t n);
+
+AST *parse(const char *text, ASTContext &ctx) {
+    Lexer lex(text);
+    Parser parser(lex, ctx);
+    AST *tree = parser.parse();
+    if (!tree || parser.hasError() || Sema().semantic(tree))
+        return nullptr;
+    return ConstFold(ctx).fold(tree);
+}
+
+// optimizes the module and adds it to the JIT, returns the address of the kernel
+template <typename Fn>
+Fn addKernel(CalcJIT &jit, std::unique_ptr<llvm::LLVMContext> ctx, std::unique_ptr<llvm::Module> m,
+             const std::string &name) {
+    m->setDataLayout(jit.getDataLayout());
+    m->setTargetTriple(jit.getTargetMachine().getTargetTriple().getTriple());
+    Optimizer(2, "").run(*m, &jit.getTargetMachine());
+    llvm::cantFail(jit.addModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(ctx))));
+    return llvm::jitTargetAddressToFunction<Fn>(llvm::cantFail(jit.lookup(name)));
+}
+
+} // namespace
+
+void benchFused(BenchHarness &h) {
+    if (!h.isEnabled("fused/"))
+        return;
+    llvm::ExitOnError exit_on_err("calc-bench: ");
+    auto jit = exit_on_err(CalcJIT::create(2));
+
+    // the fused kernel, all the formulas in one ASTContext
+    ASTContext fused_ctx;
+    std::vector<AST *> trees;
+    for (const char *f : formulas)
+        trees.push_back(parse(f, fused_ctx));
+    auto ctx = std::make_unique<llvm::LLVMContext>();
+    std::unique_ptr<llvm::Module> m = CodeGen().compileFused(trees, *ctx);
+    auto fused = addKernel<FusedFn>(*jit, std::move(ctx), std::move(m), "calc_eval_fused");
+
+    // a kernel per formula, renamed so that they can share the JIT
+    // Each one reads its columns from the same arrays as the fused kernel, in its own order.
+    std::vector<BatchFn> kernels;
+    std::vector<std::vector<const int32_t *>> kernel_cols(NumFormulas);
+    std::vector<int32_t> data(NumColumns * NumRows);
+    for (size_t i = 0; i != data.size(); ++i)
+        data[i] = int32_t(i * 2654435761u) % 1000 + 1;
+    for (size_t k = 0; k != NumFormulas; ++k) {
+        ASTContext ast_ctx;
+        AST *tree = parse(formulas[k], ast_ctx);
+        for (llvm::StringRef var : llvm::cast<WithDecl>(tree)->getVars()) {
+            size_t col = std::find(columns, columns + NumColumns, var) - columns;
+            kernel_cols[k].push_back(&data[col * NumRows]);
+        }
+        auto kctx = std::make_unique<llvm::LLVMContext>();
+        std::unique_ptr<llvm::Module> km = CodeGen().compileBatch(tree, *kctx);
+        std::string name = "calc_eval_" + std::to_string(k);
+        km->getFunction("calc_eval")->setName(name);
+        km->getGlobalVariable("calc_num_vars")->setName("calc_num_vars_" + std::to_string(k));
+        kernels.push_back(addKernel<BatchFn>(*jit, std::move(kctx), std::move(km), name));
+    }
+
+    // the fused kernel numbers the columns in the order they are first declared, as in columns
+    std::vector<const int32_t *> cols;
+    for (size_t c = 0; c != NumColumns; ++c)
+        cols.push_back(&data[c * NumRows]);
+    std::vector<int32_t> results(NumFormulas * NumRows);
+    std::vector<int32_t *> outs;
+    for (size_t k = 0; k != NumFormulas; ++k)
+        outs.push_back(&results[k * NumRows]);
+
+    uint64_t bytes = (NumColumns + NumFormulas) * NumRows * sizeof(int32_t);
+    h.run("fused/separate-8", NumRows, bytes, [&] {
+        for (size_t k = 0; k != NumFormulas; ++k)
+            kernels[k](kernel_cols[k].data(), outs[k], NumRows);
+        doNotOptimize(results.data());
+    });
+    h.run("fused/fused-8", NumRows, bytes, [&] {
+        fused(cols.data(), outs.data(), NumRows);
+        doNotOptimize(results.data());
+    });
+}
@@ -0,0 +1,53 @@
+#include "harness.h"
+#include "mem_stats.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+// The allocations are counted by the operator new of the compiler (see MemStats),
+//     the benchmarks run on the main thread.
+uint64_t allocationCount() {
+    return MemStats::threadAllocations();
+}
+
+void BenchHarness::report(llvm::raw_ostream &os) const {
+    for (const BenchResult &r : results_) {
+        double t = r.secondsPerIteration();
+        os << llvm::left_justify(r.name, 40)
+           << llvm::format("%12.3f us", t * 1e6);
+        if (r.items)
+            os << llvm::format("%12.2f Mitems/s", r.items / t / 1e6);
+        if (r.bytes)
+            os << llvm::format("%12.2f MB/s", r.bytes / t / 1e6);
+        if (r.items && r.allocs)
+            os << llvm::format("%10.3f allocs/item", r.allocs / r.items);
+        if (r.p50)
+            os << llvm::format("   p50 %10.3f us   p99 %10.3f us", r.p50 * 1e6, r.p99 * 1e6);
+        os << "\n";
+    }
+}
+
+void BenchHarness::reportJSON(llvm::raw_ostream &os) const {
+    llvm::json::OStream json(os, /*IndentSize*/2);
+    json.array([&] {
+        for (const BenchResult &r : results_) {
+            double t = r.secondsPerIteration();
+            json.object([&] {
+                json.attribute("name", r.name);
+                json.attribute("iterations", int64_t(r.iterations));
+                json.attribute("seconds_per_iteration", t);
+                if (r.items)
+                    json.attribute("items_per_second", r.items / t);
+                if (r.bytes)
+                    json.attribute("bytes_per_second", r.bytes / t);
+                json.attribute("allocs_per_iteration", r.allocs);
+                if (r.items)
+                    json.attribute("allocs_per_item", r.allocs / r.items);
+                if (r.p50) {
+                    json.attribute("p50_seconds", r.p50);
+                    json.attribute("p99_seconds", r.p99);
+                }
+            });
+        }
+    });
+    os << "\n";
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+// A small self-contained benchmark harness, so calc-bench needs nothing but LLVM.
+// Each benchmark is a function which is run repeatedly until a minimum time has passed.
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the number of calls to operator new so far on this thread (see harness.cpp)
+uint64_t allocationCount();
+
+// keeps the compiler from optimizing away a result that is otherwise unused
+template <typename T>
+inline void doNotOptimize(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double seconds; // the total time of all iterations
+    uint64_t items; // the items (e.g. nodes) processed by one iteration
+    uint64_t bytes; // the bytes processed by one iteration
+    double allocs = 0; // the calls to operator new per iteration
+    // the median and the 99th percentile of single iterations, if they were timed one by one
+    double p50 = 0;
+    double p99 = 0;
+
+    double secondsPerIteration() const { return seconds / iterations; }
+};
+
+class BenchHarness {
+    double min_time_;
+    std::string filter_;
+    std::vector<BenchResult> results_;
+
+public:
+    BenchHarness(double min_time, llvm::StringRef filter)
+        : min_time_(min_time), filter_(filter.str()) {}
+
+    // a benchmark runs only if its name contains the filter string
+    bool isEnabled(llvm::StringRef name) const {
+        return name.contains(filter_);
+    }
+
+    // Runs fn until min_time_ seconds have passed, at least once.
+    // items and bytes describe the work of one call, they are used to compute the rates.
+    template <typename Fn>
+    void run(llvm::StringRef name, uint64_t items, uint64_t bytes, Fn fn) {
+        if (!isEnabled(name))
+            return;
+        using Clock = std::chrono::steady_clock;
+        uint64_t iterations = 0;
+        uint64_t allocs = allocationCount();
+        Clock::time_point start = Clock::now();
+        double elapsed = 0;
+        do {
+            fn();
+            ++iterations;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        } while (elapsed < min_time_);
+        BenchResult r{name.str(), iterations, elapsed, items, bytes};
+        r.allocs = double(allocationCount() - allocs) / iterations;
+        results_.push_back(r);
+    }
+
+    // Like run(), but each iteration first calls setup(), which is not timed,
+    //     and passes its result to fn, e.g. a fresh module for a pass which changes it.
+    template <typename Setup, typename Fn>
+    void runWithSetup(llvm::StringRef name, uint64_t items, uint64_t bytes, Setup setup, Fn fn) {
+        if (!isEnabled(name))
+            return;
+        using Clock = std::chrono::steady_clock;
+        uint64_t iterations = 0;
+        uint64_t allocs = 0;
+        double elapsed = 0;
+        Clock::time_point end = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                                   std::chrono::duration<double>(min_time_));
+        do {
+            auto state = setup();
+            uint64_t allocs_before = allocationCount();
+            Clock::time_point start = Clock::now();
+            fn(state);
+            elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+            allocs += allocationCount() - allocs_before;
+            ++iterations;
+        } while (Clock::now() < end);
+        BenchResult r{name.str(), iterations, elapsed, items, bytes};
+        r.allocs = double(allocs) / iterations;
+        results_.push_back(r);
+    }
+
+    // Runs fn `samples` times and times each call on its own, for the latency percentiles.
+    template <typename Fn>
+    void runLatency(llvm::StringRef name, unsigned samples, Fn fn) {
+        if (!isEnabled(name) || samples == 0)
+            return;
+        using Clock = std::chrono::steady_clock;
+        std::vector<double> times;
+        times.reserve(samples);
+        double total = 0;
+        for (unsigned i = 0; i != samples; ++i) {
+            Clock::time_point start = Clock::now();
+            fn();
+            times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+            total += times.back();
+        }
+        std::sort(times.begin(), times.end());
+        BenchResult r{name.str(), samples, total, 0, 0};
+        r.p50 = times[times.size() / 2];
+        r.p99 = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+        results_.push_back(r);
+    }
+
+    const std::vector<BenchResult> &getResults() const { return results_; }
+
+    // prints one line per benchmark
+    void report(llvm::raw_ostream &os) const;
+
+    // Writes the results as a JSON array for tracking them over time, one object per benchmark:
+    //     {"name", "iterations", "seconds_per_iteration",
+    //      "items_per_second", "bytes_per_second", "allocs_per_iteration", "allocs_per_item",
+    //      "p50_seconds", "p99_seconds"}
+    // The rates are left out where the benchmark has no items or bytes, the percentiles likewise.
+    void reportJSON(llvm::raw_ostream &os) const;
+};
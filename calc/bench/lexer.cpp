@@ -0,0 +1,41 @@
+// Lexer throughput with each kind of run scanner.
+// Scalar is the byte-at-a-time loop the lexer used before, driven by the lookup table.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "workloads.h"
+#include "lexer.h"
+
+void benchLexer(BenchHarness &h) {
+    std::string input = lexerInput(8 << 20);
+
+    // the number of tokens, the same for every scanner
+    uint64_t tokens = 0;
+    {
+        Lexer lex(input, Lexer::ScanKind::Scalar);
+        Token tok;
+        for (lex.next(tok); !tok.is(Token::eoi); lex.next(tok))
+            ++tokens;
+    }
+
+    struct {
+        const char *name;
+        Lexer::ScanKind kind;
+    } const variants[] = {
+        {"lexer/scalar", Lexer::ScanKind::Scalar},
+        {"lexer/sse2", Lexer::ScanKind::SSE2},
+        {"lexer/avx2", Lexer::ScanKind::AVX2},
+    };
+    for (const auto &v : variants) {
+        if (!Lexer::isSupported(v.kind))
+            continue;
+        h.run(v.name, tokens, input.size(), [&] {
+            Lexer lex(input, v.kind);
+            Token tok;
+            uint64_t n = 0;
+            for (lex.next(tok); !tok.is(Token::eoi); lex.next(tok))
+                ++n;
+            doNotOptimize(n);
+        });
+    }
+}
@@ -0,0 +1,55 @@
+// calc-bench runs the benchmarks of the calc compiler phases on synthetic input.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+#include <system_error>
+
+static llvm::cl::opt<std::string> Filter(
+    "filter",
+    llvm::cl::desc("Only run the benchmarks whose name contains this string"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<double> MinTime(
+    "min-time",
+    llvm::cl::desc("Minimum time in seconds to run each benchmark"),
+    llvm::cl::init(0.5)
+);
+
+static llvm::cl::opt<std::string> JSONOutput(
+    "json",
+    llvm::cl::desc("Also write the results as JSON to this file, - for stdout"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::init("")
+);
+
+int main(int argc, const char **argv) {
+    llvm::InitLLVM x(argc, argv);
+    llvm::cl::ParseCommandLineOptions(
+        argc, argv, "calc-bench - benchmarks for the calc compiler\n");
+
+    BenchHarness h(MinTime, Filter);
+    benchLexer(h);
+    benchParser(h);
+    benchTraversal(h);
+    benchCompile(h);
+    benchServer(h);
+    benchPhases(h);
+    benchEmbed(h);
+    benchFused(h);
+    h.report(llvm::outs());
+
+    if (!JSONOutput.empty()) {
+        std::error_code ec;
+        llvm::raw_fd_ostream os(JSONOutput, ec);
+        if (ec) {
+            llvm::errs() << "calc-bench: can't write " << JSONOutput << ": " << ec.message() << "\n";
+            return 1;
+        }
+        h.reportJSON(os);
+    }
+    return 0;
+}
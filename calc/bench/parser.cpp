@@ -0,0 +1,36 @@
+// Parsing with tokens pulled from the lexer one at a time,
+// compared to parsing a token array filled in advance by Lexer::tokenize().
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "workloads.h"
+#include "ast.h"
+#include "lexer.h"
+#include "parser.h"
+
+void benchParser(BenchHarness &h) {
+    std::string input = balancedExpr(1 << 18);
+
+    h.run("parser/stream", 0, input.size(), [&] {
+        ASTContext ctx;
+        Lexer lex(input);
+        Parser parser(lex, ctx);
+        doNotOptimize(parser.parse());
+    });
+
+    h.run("parser/tokenize", 0, input.size(), [&] {
+        Lexer lex(input);
+        TokenBuffer tokens;
+        lex.tokenize(tokens);
+        doNotOptimize(tokens.size());
+    });
+
+    h.run("parser/pretokenized", 0, input.size(), [&] {
+        ASTContext ctx;
+        Lexer lex(input);
+        TokenBuffer tokens;
+        lex.tokenize(tokens);
+        Parser parser(tokens, ctx);
+        doNotOptimize(parser.parse());
+    });
+}
@@ -0,0 +1,157 @@
+// Every phase of the compiler on each shape of input (see workloads.h),
+// from the lexer to the end-to-end time until the JIT'd expression returns its result.
+//
+// The front end (lexer, parser, sema) runs on large inputs.
+// IR construction, optimization and the end-to-end run use smaller ones,
+//     because the LLVM passes get slow, and some recursive, on long dependency chains.
+// The items of the lexer are tokens, those of the other phases are AST nodes.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "workloads.h"
+#include "ast.h"
+#include "code_gen.h"
+#include "const_fold.h"
+#include "jit.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "sema.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+const unsigned FrontEndSize = 1 << 16;
+const unsigned BackEndSize = 1 << 10;
+
+struct Workload {
+    const char *name;
+    std::string (*generate)(unsigned n);
+};
+
+const Workload workloads[] = {
+    {"flat-sum", flatSumExpr},
+    {"nested", nestedExpr},
+    {"many-vars", manyVarsExpr},
+    {"repeated", repeatedExpr},
+};
+
+// the parsed input of a benchmark, the tree lives as long as the context
+struct Parsed {
+    ASTContext ctx;
+    AST *tree = nullptr;
+    uint64_t nodes = 0;
+
+    explicit Parsed(const std::string &input) {
+        Lexer lex(input);
+        Parser parser(lex, ctx);
+        tree = parser.parse();
+        if (parser.hasError() || Sema().semantic(tree))
+            tree = nullptr;
+        nodes = ctx.size();
+    }
+};
+
+void benchFrontEnd(BenchHarness &h, const Workload &w) {
+    std::string input = w.generate(FrontEndSize);
+    Parsed parsed(input);
+    if (!parsed.tree) {
+        llvm::errs() << "phases: the " << w.name << " input does not compile\n";
+        return;
+    }
+
+    uint64_t tokens = 0;
+    {
+        Lexer lex(input);
+        Token tok;
+        for (lex.next(tok); !tok.is(Token::eoi); lex.next(tok))
+            ++tokens;
+    }
+    h.run(std::string("phases/lex/") + w.name, tokens, input.size(), [&] {
+        Lexer lex(input);
+        Token tok;
+        uint64_t n = 0;
+        for (lex.next(tok); !tok.is(Token::eoi); lex.next(tok))
+            ++n;
+        doNotOptimize(n);
+    });
+
+    h.run(std::string("phases/parse/") + w.name, parsed.nodes, input.size(), [&] {
+        ASTContext ctx;
+        Lexer lex(input);
+        Parser parser(lex, ctx);
+        doNotOptimize(parser.parse());
+    });
+
+    h.run(std::string("phases/sema/") + w.name, parsed.nodes, input.size(), [&] {
+        doNotOptimize(Sema().semantic(parsed.tree));
+    });
+}
+
+void benchBackEnd(BenchHarness &h, const Workload &w, CalcJIT &jit) {
+    std::string input = w.generate(BackEndSize);
+    Parsed parsed(input);
+    if (!parsed.tree) {
+        llvm::errs() << "phases: the " << w.name << " input does not compile\n";
+        return;
+    }
+
+    llvm::LLVMContext llvm_ctx;
+    h.run(std::string("phases/irgen/") + w.name, parsed.nodes, input.size(), [&] {
+        doNotOptimize(CodeGen().compile(parsed.tree, llvm_ctx));
+    });
+
+    h.runWithSetup(std::string("phases/optimize/") + w.name, parsed.nodes, input.size(),
+        [&] {
+            std::unique_ptr<llvm::Module> m = CodeGen().compile(parsed.tree, llvm_ctx);
+            m->setDataLayout(jit.getDataLayout());
+            m->setTargetTriple(jit.getTargetMachine().getTargetTriple().getTriple());
+            return m;
+        },
+        [&](std::unique_ptr<llvm::Module> &m) {
+            Optimizer(2, "").run(*m, &jit.getTargetMachine());
+        });
+
+    // From the text to the result, like a request to the server which compiles right away.
+    // The JIT is shared, creating it is a one-time cost of the process.
+    std::vector<int32_t> vars(llvm::cast<WithDecl>(parsed.tree)->getVars().size(), 3);
+    unsigned n = 0;
+    h.run(std::string("phases/end-to-end/") + w.name, parsed.nodes, input.size(), [&] {
+        ASTContext ast_ctx;
+        Lexer lex(input);
+        Parser parser(lex, ast_ctx);
+        AST *tree = parser.parse();
+        if (parser.hasError() || Sema().semantic(tree))
+            return;
+        tree = ConstFold(ast_ctx).fold(tree);
+
+        auto ctx = std::make_unique<llvm::LLVMContext>();
+        auto m = std::make_unique<llvm::Module>("calc.bench", *ctx);
+        std::string name = "calc_bench_" + std::to_string(n++);
+        CodeGen().compileFunction(tree, name, *m, /*safe*/true);
+        m->setDataLayout(jit.getDataLayout());
+        m->setTargetTriple(jit.getTargetMachine().getTargetTriple().getTriple());
+        Optimizer(2, "").run(*m, &jit.getTargetMachine());
+        llvm::cantFail(jit.addModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(ctx))));
+        auto fn = llvm::jitTargetAddressToFunction<int32_t (*)(const int32_t *)>(
+            llvm::cantFail(jit.lookup(name)));
+        doNotOptimize(fn(vars.data()));
+    });
+}
+
+} // namespace
+
+void benchPhases(BenchHarness &h) {
+    for (const Workload &w : workloads)
+        benchFrontEnd(h, w);
+
+    llvm::ExitOnError exit_on_err("calc-bench: ");
+    auto jit = exit_on_err(CalcJIT::create(2));
+    for (const Workload &w : workloads)
+        benchBackEnd(h, w, *jit);
+}
@@ -0,0 +1,86 @@
+// The latency of a request to a warm compile server (calc -serve), with the expressions compiled
+// or interpreted (see CalcServer), compared to starting a fresh calc process for the same request.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "server.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <string>
+
+static llvm::cl::opt<std::string> CalcPath(
+    "calc",
+    llvm::cl::desc("The calc executable for the per-process benchmark (default: the one of this build)"),
+    llvm::cl::init("")
+);
+
+// the calc executable next to calc-bench in the build tree
+static std::string findCalc() {
+    if (!CalcPath.empty())
+        return CalcPath;
+    static int anchor;
+    llvm::SmallString<256> path(llvm::sys::fs::getMainExecutable("calc-bench", &anchor));
+    llvm::sys::path::remove_filename(path);
+    llvm::sys::path::append(path, "..", "src", "calc");
+    return llvm::sys::fs::can_execute(path) ? path.str().str() : std::string();
+}
+
+void benchServer(BenchHarness &h) {
+    if (!h.isEnabled("server/"))
+        return;
+    const unsigned samples = 200;
+    const char *request = "eval 3 4 5\nwith a,b,c: (a+b)*c - a/b";
+
+    llvm::ExitOnError exit_on_err("calc-bench: ");
+    // threshold 0: every expression is compiled the first time it is seen
+    auto server = exit_on_err(CalcServer::create(2, "", 64 << 20, /*jit_threshold*/0));
+    // a threshold which is never reached: every expression stays in the interpreter
+    auto interp = exit_on_err(CalcServer::create(2, "", 64 << 20, UINT64_MAX));
+
+    // the expression is compiled once, then every request finds it
+    h.runLatency("server/warm", samples, [&] {
+        doNotOptimize(server->handle(request));
+    });
+    h.runLatency("server/warm-interp", samples, [&] {
+        doNotOptimize(interp->handle(request));
+    });
+
+    // a new expression each time: the front end, the optimizer and the JIT run for every request
+    unsigned n = 0;
+    h.runLatency("server/compile", samples, [&] {
+        std::string req = "eval 3 4\nwith a,b: a*b+" + std::to_string(n++);
+        doNotOptimize(server->handle(req));
+    });
+    // the same with the interpreter, the first evaluation only costs the translation to bytecode
+    h.runLatency("server/compile-interp", samples, [&] {
+        std::string req = "eval 3 4\nwith a,b: a*b+" + std::to_string(n++);
+        doNotOptimize(interp->handle(req));
+    });
+
+    // the same request sent to a fresh process, which has to set everything up first
+    std::string calc = findCalc();
+    if (calc.empty()) {
+        llvm::errs() << "calc-bench: calc not found, use -calc=<path> for server/process\n";
+        return;
+    }
+    llvm::SmallString<128> req_file;
+    int fd;
+    if (llvm::sys::fs::createTemporaryFile("calc-bench", "req", fd, req_file))
+        return;
+    {
+        llvm::raw_fd_ostream os(fd, /*shouldClose*/true);
+        os << llvm::StringRef(request).size() << "\n" << request;
+    }
+    llvm::StringRef args[] = {calc, "-serve", "-O2"};
+    llvm::Optional<llvm::StringRef> redirects[] = {llvm::StringRef(req_file), llvm::StringRef(""), llvm::StringRef("")};
+    h.runLatency("server/process", samples / 10, [&] {
+        doNotOptimize(llvm::sys::ExecuteAndWait(calc, args, llvm::None, redirects));
+    });
+    llvm::sys::fs::remove(req_file);
+}
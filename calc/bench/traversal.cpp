@@ -0,0 +1,116 @@
+// Compares the kind-tag/CRTP dispatch of ASTVisitorBase with the double dispatch
+// through virtual accept() and visit() methods, which the AST classes used before.
+
+#include "benchmarks.h"
+#include "harness.h"
+#include "workloads.h"
+#include "ast.h"
+#include "lexer.h"
+#include "parser.h"
+#include <memory>
+#include <vector>
+
+namespace {
+
+// counts the nodes, the same work for both variants
+class CountingVisitor : public ASTVisitorBase<CountingVisitor> {
+public:
+    uint64_t count = 0;
+
+    void visit(Factor &) { ++count; }
+    void visit(BinaryOp &node) {
+        ++count;
+        node.getLeft()->accept(*this);
+        node.getRight()->accept(*this);
+    }
+    void visit(WithDecl &node) {
+        ++count;
+        node.getExpr()->accept(*this);
+    }
+};
+
+// The old design: every node has a vtable, accept() is virtual
+// and calls the virtual visit() of the visitor.
+class VFactor;
+class VBinaryOp;
+
+class VVisitor {
+public:
+    virtual ~VVisitor() {}
+    virtual void visit(VFactor &) = 0;
+    virtual void visit(VBinaryOp &) = 0;
+};
+
+class VNode {
+public:
+    virtual ~VNode() {}
+    virtual void accept(VVisitor &v) = 0;
+};
+
+class VFactor : public VNode {
+public:
+    void accept(VVisitor &v) override { v.visit(*this); }
+};
+
+class VBinaryOp : public VNode {
+public:
+    VNode *left;
+    VNode *right;
+    VBinaryOp(VNode *l, VNode *r) : left(l), right(r) {}
+    void accept(VVisitor &v) override { v.visit(*this); }
+};
+
+class VCountingVisitor : public VVisitor {
+public:
+    uint64_t count = 0;
+
+    void visit(VFactor &) override { ++count; }
+    void visit(VBinaryOp &node) override {
+        ++count;
+        node.left->accept(*this);
+        node.right->accept(*this);
+    }
+};
+
+// builds a copy of the tree out of the virtual node classes
+VNode *mirror(Expr *e, std::vector<std::unique_ptr<VNode>> &nodes) {
+    VNode *node;
+    if (auto *op = llvm::dyn_cast<BinaryOp>(e))
+        node = new VBinaryOp(mirror(op->getLeft(), nodes), mirror(op->getRight(), nodes));
+    else
+        node = new VFactor();
+    nodes.emplace_back(node);
+    return node;
+}
+
+} // namespace
+
+void benchTraversal(BenchHarness &h) {
+    for (unsigned n : {1000u, 100000u, 1000000u}) {
+        std::string input = balancedExpr(n);
+        ASTContext ctx;
+        Lexer lex(input);
+        Parser parser(lex, ctx);
+        AST *tree = parser.parse();
+        if (!tree || parser.hasError()) {
+            llvm::errs() << "traversal: the generated input does not parse\n";
+            return;
+        }
+        uint64_t nodes = ctx.size();
+
+        std::string suffix = "/" + std::to_string(n);
+        h.run("traversal/crtp" + suffix, nodes, 0, [&] {
+            CountingVisitor v;
+            tree->accept(v);
+            doNotOptimize(v.count);
+        });
+
+        std::vector<std::unique_ptr<VNode>> vnodes;
+        VNode *vtree = mirror(llvm::cast<Expr>(tree), vnodes);
+        h.run("traversal/virtual" + suffix, nodes, 0, [&] {
+            VCountingVisitor v;
+            vtree->accept(v);
+            doNotOptimize(v.count);
+        });
+    }
+}
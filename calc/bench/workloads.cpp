@@ -0,0 +1,123 @@
+#include "workloads.h"
+
+std::string varName(unsigned i) {
+    std::string name;
+    do {
+        name.insert(name.begin(), char('a' + i % 26));
+        i /= 26;
+    } while (i);
+    return "v" + name;
+}
+
+static void appendBalanced(std::string &out, unsigned first, unsigned n, unsigned depth) {
+    if (n == 1) {
+        out += varName(first);
+        return;
+    }
+    static const char ops[] = {'+', '*', '-', '/'};
+    unsigned half = n / 2;
+    out += '(';
+    appendBalanced(out, first, half, depth + 1);
+    out += ops[depth % 4];
+    appendBalanced(out, first + half, n - half, depth + 1);
+    out += ')';
+}
+
+std::string balancedExpr(unsigned n) {
+    std::string out;
+    appendBalanced(out, 0, n, 0);
+    return out;
+}
+
+std::string lexerInput(size_t bytes) {
+    static const char *const pieces[] = {
+        "totalRevenue", " + ", "1234567890", "   *   ", "(", "quantityOrdered",
+        " - ", "42", ")", "\n        / ", "discountFactor", " ", "+", "  ", "987654",
+        "\n", "with", " ", "x", ": ", "unitPriceInCents", "\t\t- ", "7",
+    };
+    std::string out;
+    out.reserve(bytes + 64);
+    unsigned i = 0;
+    while (out.size() < bytes)
+        out += pieces[i++ % (sizeof(pieces) / sizeof(pieces[0]))];
+    return out;
+}
+
+std::string formulaFile(unsigned n) {
+    std::string out;
+    for (unsigned i = 0; i != n; ++i) {
+        unsigned vars = 1 + i % 5;
+        out += "with ";
+        for (unsigned v = 0; v != vars; ++v) {
+            if (v)
+                out += ',';
+            out += varName(v);
+        }
+        out += ": ";
+        for (unsigned t = 0; t != 8; ++t) {
+            if (t)
+                out += t % 3 ? '+' : '-';
+            out += varName((i + t) % vars) + "*" + std::to_string(1 + (i * 7 + t * 13) % 97);
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+// the declaration of the first n variables
+static std::string withDecl(unsigned n) {
+    std::string out = "with ";
+    for (unsigned v = 0; v != n; ++v) {
+        if (v)
+            out += ',';
+        out += varName(v);
+    }
+    return out + ": ";
+}
+
+std::string flatSumExpr(unsigned n) {
+    std::string out = withDecl(8);
+    for (unsigned i = 0; i != n; ++i) {
+        if (i)
+            out += '+';
+        out += i % 2 ? std::to_string(i) : varName(i / 2 % 8);
+    }
+    return out;
+}
+
+std::string nestedExpr(unsigned n) {
+    static const char ops[] = {'+', '*', '-'};
+    std::string out = withDecl(1);
+    out.append(n, '(');
+    out += varName(0);
+    for (unsigned i = 0; i != n; ++i) {
+        out += ')';
+        if (i + 1 != n) {
+            out += ops[i % 3];
+            out += std::to_string(i % 9 + 1);
+        }
+    }
+    return out;
+}
+
+std::string manyVarsExpr(unsigned n) {
+    static const char ops[] = {'+', '*', '-'};
+    std::string out = withDecl(n);
+    for (unsigned i = 0; i != n; ++i) {
+        if (i)
+            out += ops[i % 3];
+        out += varName(i);
+    }
+    return out;
+}
+
+std::string repeatedExpr(unsigned n) {
+    static const char *const terms[] = {"(va*vb+vc)", "(va-vc)", "(vb/7)", "(va*vb+vc)*(va-vc)"};
+    std::string out = withDecl(3);
+    for (unsigned i = 0; i != n; ++i) {
+        if (i)
+            out += i % 2 ? '+' : '-';
+        out += terms[i % 4];
+    }
+    return out;
+}
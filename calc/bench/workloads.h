@@ -0,0 +1,39 @@
+#pragma once
+
+// Generators for synthetic calc input.
+
+#include <string>
+
+// the i-th of a sequence of distinct variable names: va, vb, ..., vz, vba, ...
+std::string varName(unsigned i);
+
+// A balanced tree of n distinct variables, e.g. ((va+vb)*(vc+vd)).
+// The nesting depth grows with log(n), so the recursive walks can handle any size.
+std::string balancedExpr(unsigned n);
+
+// About `bytes` bytes of tokens as they appear in generated files:
+// long identifiers and numbers, separated by runs of spaces and newlines.
+// It is meant for the lexer only, it doesn't parse as a whole.
+std::string lexerInput(size_t bytes);
+
+// A file of n formulas, one per line, in the form accepted by calc -f.
+// Each formula declares a few variables and sums some products of them with constants.
+std::string formulaFile(unsigned n);
+
+// The shapes of input which stress different parts of the compiler, each with n operands.
+// All of them declare their variables, so they pass Sema.
+//
+// A flat sum of variables and numbers, the tree is a left-leaning chain of depth n:
+//     with va,vb,...: va+1+vb+2+...
+std::string flatSumExpr(unsigned n);
+
+// n levels of parentheses around a single variable:
+//     with va: ((((va)+1)*2)-3)...
+std::string nestedExpr(unsigned n);
+
+// n distinct variables, each used once: with va,vb,...: va+vb*vc-vd+...
+std::string manyVarsExpr(unsigned n);
+
+// n copies of the same few subexpressions, which the ASTContext builds once each:
+//     with va,vb,vc: (va*vb+vc)+(va*vb+vc)*(va-vc)+...
+std::string repeatedExpr(unsigned n);
@@ -0,0 +1,292 @@
+// the batch runtime, an alternative to rtcalc.c for kernels generated with calc -batch
+// rtcalc.c asks for each value on the terminal, this one streams a whole file of rows through calc_eval()
+// which runtime is used is decided when linking:
+//
+//     calc -batch -O2 -c "with a,b: a*b" -o kernel.o
+//     cc -O2 rtcalc_batch.c kernel.o -no-pie -o kernel
+//     ./kernel input.csv [output]     one row per line, the values separated by ','
+//                                     writes one result per line
+//     ./kernel -b input.bin [output]  rows of int32 values in the byte order of the host
+//                                     writes the results as int32 values
+//
+// The input is memory-mapped and decoded block by block into the columns for calc_eval(),
+//     the results are formatted into a large buffer which is written with one write() call per MB.
+// Numbers wrap around modulo 2^32, like the literals in an expression.
+//
+// A fused kernel of calc -f exprs.calc -batch -fuse is linked the same way, it writes one value
+//     per expression for each row: separated by ',' on a line, or as consecutive int32 values.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// generated by calc -batch, or with -fuse; the kernel which is not linked in is NULL
+void calc_eval(const int32_t *const *cols, int32_t *out, size_t n) __attribute__((weak));
+void calc_eval_fused(const int32_t *const *cols, int32_t *const *outs, size_t n) __attribute__((weak));
+extern const int32_t calc_num_vars;
+extern const int32_t calc_num_outputs __attribute__((weak));
+
+// the number of rows passed to calc_eval() at once; the columns of a block stay in the L1/L2 cache
+#define BLOCK_ROWS 4096
+#define OUT_BUFFER_SIZE (1 << 20)
+// the longest formatted result: "-2147483648\n"
+#define MAX_RESULT_LEN 12
+
+static const char *input_name;
+
+static void fail(const char *msg) {
+    fprintf(stderr, "calc: %s\n", msg);
+    exit(1);
+}
+
+static void fail_at(size_t line, const char *msg) {
+    fprintf(stderr, "calc: %s:%zu: %s\n", input_name, line, msg);
+    exit(1);
+}
+
+// the output buffer
+static int out_fd;
+static char *out_buf;
+static size_t out_len;
+
+static void flush_output(void) {
+    size_t done = 0;
+    while (done < out_len) {
+        ssize_t res = write(out_fd, out_buf + done, out_len - done);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            fail("can't write the output");
+        }
+        done += (size_t)res;
+    }
+    out_len = 0;
+}
+
+// "00" "01" ... "99", two digits are formatted at once
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// formats v followed by sep at p, returns the end
+static char *format_int(char *p, int32_t v, char sep) {
+    uint32_t u = (uint32_t)v;
+    if (v < 0) {
+        *p++ = '-';
+        u = 0u - u;
+    }
+    char tmp[10];
+    char *t = tmp + sizeof(tmp);
+    while (u >= 100) {
+        uint32_t pair = (u % 100) * 2;
+        u /= 100;
+        t -= 2;
+        memcpy(t, digit_pairs + pair, 2);
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, digit_pairs + u * 2, 2);
+    } else {
+        *--t = (char)('0' + u);
+    }
+    size_t len = (size_t)(tmp + sizeof(tmp) - t);
+    memcpy(p, t, len);
+    p[len] = sep;
+    return p + len + 1;
+}
+
+static void write_text(int32_t *const *outs, size_t num_outputs, size_t n) {
+    for (size_t i = 0; i != n; ++i) {
+        if (OUT_BUFFER_SIZE - out_len < num_outputs * MAX_RESULT_LEN)
+            flush_output();
+        char *p = out_buf + out_len;
+        for (size_t k = 0; k != num_outputs; ++k)
+            p = format_int(p, outs[k][i], k + 1 == num_outputs ? '\n' : ',');
+        out_len = (size_t)(p - out_buf);
+    }
+}
+
+static void write_binary(int32_t *const *outs, size_t num_outputs, size_t n) {
+    if (num_outputs == 1) {
+        size_t bytes = n * sizeof(int32_t);
+        if (OUT_BUFFER_SIZE - out_len < bytes)
+            flush_output();
+        memcpy(out_buf + out_len, outs[0], bytes);
+        out_len += bytes;
+        return;
+    }
+    // the values of a row are written next to each other, like the rows of the input
+    for (size_t i = 0; i != n; ++i) {
+        if (OUT_BUFFER_SIZE - out_len < num_outputs * sizeof(int32_t))
+            flush_output();
+        for (size_t k = 0; k != num_outputs; ++k) {
+            memcpy(out_buf + out_len, &outs[k][i], sizeof(int32_t));
+            out_len += sizeof(int32_t);
+        }
+    }
+}
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// parses an optionally signed decimal number, returns NULL if there is none
+static const char *parse_int(const char *p, const char *end, int32_t *val) {
+    int neg = 0;
+    if (p != end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        ++p;
+    }
+    const char *digits = p;
+    uint32_t v = 0;
+    while (p != end && (unsigned)(*p - '0') < 10) {
+        v = v * 10 + (uint32_t)(*p - '0');
+        ++p;
+    }
+    if (p == digits)
+        return NULL;
+    *val = (int32_t)(neg ? 0u - v : v);
+    return p;
+}
+
+// decodes up to BLOCK_ROWS rows of the CSV input into the columns, returns the number of rows
+static size_t decode_csv(const char **pp, const char *end, size_t *line, int32_t **cols, size_t num_vars) {
+    const char *p = *pp;
+    size_t rows = 0;
+    while (rows < BLOCK_ROWS && p != end) {
+        // empty lines are skipped
+        if (*p == '\n' || *p == '\r') {
+            *line += *p == '\n';
+            ++p;
+            continue;
+        }
+        for (size_t k = 0; k != num_vars; ++k) {
+            while (p != end && is_blank(*p))
+                ++p;
+            p = parse_int(p, end, &cols[k][rows]);
+            if (!p)
+                fail_at(*line, "expected a number");
+            while (p != end && is_blank(*p))
+                ++p;
+            if (k + 1 != num_vars) {
+                if (p == end || *p != ',')
+                    fail_at(*line, "expected ','");
+                ++p;
+            }
+        }
+        if (p != end && *p == '\r')
+            ++p;
+        if (p != end) {
+            if (*p != '\n')
+                fail_at(*line, "expected the end of the line");
+            ++p;
+            ++*line;
+        }
+        ++rows;
+    }
+    *pp = p;
+    return rows;
+}
+
+// copies up to BLOCK_ROWS rows of the binary input into the columns, returns the number of rows
+static size_t decode_binary(const char **pp, const char *end, int32_t **cols, size_t num_vars) {
+    const char *p = *pp;
+    size_t row_size = num_vars * sizeof(int32_t);
+    size_t rows = (size_t)(end - p) / row_size;
+    if (rows > BLOCK_ROWS)
+        rows = BLOCK_ROWS;
+    for (size_t r = 0; r != rows; ++r) {
+        for (size_t k = 0; k != num_vars; ++k)
+            memcpy(&cols[k][r], p + k * sizeof(int32_t), sizeof(int32_t));
+        p += row_size;
+    }
+    *pp = p;
+    return rows;
+}
+
+int main(int argc, char **argv) {
+    int binary = argc > 1 && strcmp(argv[1], "-b") == 0;
+    if (binary) {
+        --argc;
+        ++argv;
+    }
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s [-b] <input> [<output>]\n", argv[0]);
+        return 1;
+    }
+    input_name = argv[1];
+
+    int in_fd = open(input_name, O_RDONLY);
+    struct stat st;
+    if (in_fd < 0 || fstat(in_fd, &st) != 0) {
+        fprintf(stderr, "calc: can't open %s\n", input_name);
+        return 1;
+    }
+    out_fd = STDOUT_FILENO;
+    if (argc == 3) {
+        out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "calc: can't open %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    if (!calc_eval && !calc_eval_fused)
+        fail("no kernel, link an object of calc -batch");
+    size_t num_vars = (size_t)calc_num_vars;
+    size_t num_outputs = calc_eval_fused ? (size_t)calc_num_outputs : 1;
+    size_t size = (size_t)st.st_size;
+    if (binary && num_vars == 0)
+        fail("binary input needs an expression with variables");
+    if (binary && size % (num_vars * sizeof(int32_t)) != 0)
+        fail("the size of the binary input is not a multiple of the row size");
+
+    const char *data = NULL;
+    if (size != 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (data == MAP_FAILED)
+            fail("can't map the input");
+        // the file is read once from the front to the back
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    // the columns of one block, and the results of each expression
+    int32_t *storage = malloc((num_vars + num_outputs) * BLOCK_ROWS * sizeof(int32_t));
+    int32_t **cols = malloc((num_vars + num_outputs) * sizeof(int32_t *));
+    out_buf = malloc(OUT_BUFFER_SIZE);
+    if (!storage || !cols || !out_buf || num_outputs * MAX_RESULT_LEN > OUT_BUFFER_SIZE)
+        fail("out of memory");
+    for (size_t k = 0; k != num_vars + num_outputs; ++k)
+        cols[k] = storage + k * BLOCK_ROWS;
+    int32_t **outs = cols + num_vars;
+
+    const char *p = data, *end = data + size;
+    size_t line = 1;
+    while (p != end) {
+        size_t rows = binary ? decode_binary(&p, end, cols, num_vars)
+                             : decode_csv(&p, end, &line, cols, num_vars);
+        if (rows == 0)
+            break;
+        if (calc_eval_fused)
+            calc_eval_fused((const int32_t *const *)cols, outs, rows);
+        else
+            calc_eval((const int32_t *const *)cols, outs[0], rows);
+        if (binary)
+            write_binary(outs, num_outputs, rows);
+        else
+            write_text(outs, num_outputs, rows);
+    }
+    flush_output();
+
+    if (size != 0)
+        munmap((void *)data, size);
+    close(in_fd);
+    return 0;
+}
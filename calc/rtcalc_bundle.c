@@ -0,0 +1,122 @@
+// the runtime for bundles of formulas, see rtcalc_bundle.h and BundleWriter in src/bundle.h
+//
+// The library exports one symbol, the table calc_bundle_table:
+//     uint32_t magic, version, num_formulas, num_buckets
+//     struct { uint32_t name; int32_t fn; uint32_t num_vars; } entries[num_formulas]   sorted by name
+//     uint32_t seeds[num_buckets]
+//     uint32_t slots[num_formulas]
+//     char names[]                                                   NUL-terminated
+// name is the offset of the name in names, fn the offset of the function from the table.
+
+#include "rtcalc_bundle.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALC_BUNDLE_MAGIC 0x424c4143u
+#define CALC_BUNDLE_VERSION 1u
+
+struct calc_bundle_entry {
+    uint32_t name;
+    int32_t fn;
+    uint32_t num_vars;
+};
+
+struct calc_bundle {
+    void *dl;
+    const char *base; // the table
+    uint32_t num_formulas;
+    uint32_t num_buckets;
+    const struct calc_bundle_entry *entries;
+    const uint32_t *seeds;
+    const uint32_t *slots;
+    const char *names;
+};
+
+static const char *last_error = "";
+
+// FNV-1a with a seed, then the finalizer of MurmurHash3 to spread the bits
+// must be the same as BundleWriter::hash()
+static uint32_t calc_bundle_hash(const char *s, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *s; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+calc_bundle *calc_bundle_open(const char *path) {
+    // lazy binding: nothing in the library is resolved before it is used
+    void *dl = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+    if (!dl) {
+        last_error = dlerror();
+        return NULL;
+    }
+    const uint32_t *header = (const uint32_t *)dlsym(dl, "calc_bundle_table");
+    if (!header || header[0] != CALC_BUNDLE_MAGIC || header[1] != CALC_BUNDLE_VERSION) {
+        last_error = "not a calc bundle, or from another version of calc";
+        dlclose(dl);
+        return NULL;
+    }
+    calc_bundle *b = (calc_bundle *)malloc(sizeof(calc_bundle));
+    if (!b) {
+        last_error = "out of memory";
+        dlclose(dl);
+        return NULL;
+    }
+    b->dl = dl;
+    b->base = (const char *)header;
+    b->num_formulas = header[2];
+    b->num_buckets = header[3];
+    b->entries = (const struct calc_bundle_entry *)(header + 4);
+    b->seeds = (const uint32_t *)(b->entries + b->num_formulas);
+    b->slots = b->seeds + b->num_buckets;
+    b->names = (const char *)(b->slots + b->num_formulas);
+    return b;
+}
+
+const char *calc_bundle_error(void) {
+    return last_error;
+}
+
+void calc_bundle_close(calc_bundle *b) {
+    if (!b)
+        return;
+    dlclose(b->dl);
+    free(b);
+}
+
+calc_formula_fn calc_bundle_get(const calc_bundle *b, uint32_t i, uint32_t *num_vars) {
+    if (i >= b->num_formulas)
+        return NULL;
+    if (num_vars)
+        *num_vars = b->entries[i].num_vars;
+    return (calc_formula_fn)(b->base + b->entries[i].fn);
+}
+
+calc_formula_fn calc_bundle_lookup(const calc_bundle *b, const char *name, uint32_t *num_vars) {
+    if (b->num_formulas == 0)
+        return NULL;
+    // the bucket gives the seed, the seed the slot, the slot the entry
+    uint32_t bucket = calc_bundle_hash(name, 0) % b->num_buckets;
+    uint32_t slot = calc_bundle_hash(name, b->seeds[bucket]) % b->num_formulas;
+    uint32_t i = b->slots[slot];
+    // a name which is not in the bundle lands on some other entry
+    if (strcmp(b->names + b->entries[i].name, name) != 0)
+        return NULL;
+    return calc_bundle_get(b, i, num_vars);
+}
+
+uint32_t calc_bundle_size(const calc_bundle *b) {
+    return b->num_formulas;
+}
+
+const char *calc_bundle_name(const calc_bundle *b, uint32_t i) {
+    return i < b->num_formulas ? b->names + b->entries[i].name : NULL;
+}
@@ -0,0 +1,48 @@
+// the runtime for bundles of formulas built with calc -f -bundle (see BundleWriter)
+//
+//     calc -f formulas.calc -bundle -O2 -o libformulas.so
+//     cc -O2 app.c rtcalc_bundle.c -ldl -o app
+//
+//     calc_bundle *b = calc_bundle_open("./libformulas.so");
+//     uint32_t n;
+//     calc_formula_fn f = calc_bundle_lookup(b, "revenue", &n);
+//     int32_t vars[] = {3, 4};
+//     int32_t result = f(vars);   // n values
+//     calc_bundle_close(b);
+//
+// The formulas compute with wrap-around and x/0 is 0, like the safe code of the server.
+
+#ifndef RTCALC_BUNDLE_H
+#define RTCALC_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a formula, vars holds the values of its variables in the order of their declaration
+typedef int32_t (*calc_formula_fn)(const int32_t *vars);
+
+typedef struct calc_bundle calc_bundle;
+
+// Loads the library with lazy binding.
+// Returns NULL if it can't be loaded or is not a bundle, calc_bundle_error() tells why.
+calc_bundle *calc_bundle_open(const char *path);
+const char *calc_bundle_error(void);
+void calc_bundle_close(calc_bundle *b);
+
+// returns the formula with the name, or NULL; num_vars may be NULL
+calc_formula_fn calc_bundle_lookup(const calc_bundle *b, const char *name, uint32_t *num_vars);
+
+// the formulas in the order of their names, 0 <= i < calc_bundle_size(b)
+uint32_t calc_bundle_size(const calc_bundle *b);
+const char *calc_bundle_name(const calc_bundle *b, uint32_t i);
+calc_formula_fn calc_bundle_get(const calc_bundle *b, uint32_t i, uint32_t *num_vars);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
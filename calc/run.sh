@@ -11,4 +11,103 @@ clang-15 ./output/bin/calc.expr.s rtcalc.c  -isysroot `xcrun --show-sdk-path` -o
 ./output/bin/calc.out
 
 #   not sure if this will work on linux:
-#       clang ./output/bin/calc.expr.s rtcalc.c -o ./output/bin/calc.out
\ No newline at end of file
+#       clang ./output/bin/calc.expr.s rtcalc.c -o ./output/bin/calc.out
+
+echo ''
+echo '===================='
+echo ''
+# the same expression, compiled and run in-process by the ORC JIT (no llc, no clang)
+output/bin/calc --jit "with a: a*3"
+
+
+echo ''
+echo '===================='
+echo ''
+# or emit the object file directly, without printing the IR and running llc
+#   -c uses the static relocation model like llc does, hence -no-pie on linux;
+#   -shared emits position independent code that can go into a shared library
+output/bin/calc -c "with a: a*3" -o ./output/bin/calc.expr.o
+# clang ./output/bin/calc.expr.o rtcalc.c -no-pie -o ./output/bin/calc.out
+output/bin/calc -shared "with a: a*3" -o ./output/bin/calc.expr.pic.o
+# clang -shared ./output/bin/calc.expr.pic.o -o ./output/bin/libcalcexpr.so
+
+
+echo ''
+echo '===================='
+echo ''
+# a batch kernel: void calc_eval(const int32_t *const *cols, int32_t *out, size_t n)
+#   cols[0] is the column of a, cols[1] the column of b; at -O2 the loop is vectorized
+output/bin/calc -batch -O2 "with a,b: (a+b)/(a-b)"
+# link the kernel with the batch runtime instead of rtcalc.c to run it over a file of rows
+#   (one row per line, the values of a and b separated by ','; -b for binary int32 rows)
+output/bin/calc -batch -O2 -c "with a,b: (a+b)/(a-b)" -o ./output/bin/calc.kernel.o
+# clang -O2 rtcalc_batch.c ./output/bin/calc.kernel.o -no-pie -o ./output/bin/calc.kernel
+# ./output/bin/calc.kernel input.csv output.txt
+# -mcpu=native tunes the kernel for this machine (-mattr=+avx2,... for single features),
+#   -multiversion builds SSE2, AVX2 and AVX-512 variants, the best one is picked when the program starts
+output/bin/calc -batch -O2 -mcpu=native -c "with a,b: (a+b)/(a-b)" -o ./output/bin/calc.kernel.native.o
+output/bin/calc -batch -O2 -multiversion -c "with a,b: (a+b)/(a-b)" -o ./output/bin/calc.kernel.mv.o
+# -fuse: the expressions of a file in one kernel calc_eval_fused(cols, outs, n), which reads each
+#   variable once per row and computes the shared subexpressions (here price*qty) once;
+#   the batch runtime writes the results of a row separated by ','
+printf 'with price,qty: price*qty\nwith price,qty,cost: price*qty - cost*qty\n' > ./output/report.calc
+output/bin/calc -f ./output/report.calc -batch -fuse -O2
+
+
+echo ''
+echo '===================='
+echo ''
+# many expressions from a file, one per line or separated by ';'
+#   the i-th expression becomes the function int32_t calc_expr_<i>(const int32_t *vars)
+#   with -c, the modules of 1024 expressions each go to calc.expr.o, calc.expr.1.o, ...
+#   -j N compiles the modules on N threads, the output is the same for any N
+printf 'with a,b: a*b+1\n3*4; with x: x/2\n' > ./output/bin/exprs.calc
+output/bin/calc -f ./output/bin/exprs.calc -O2
+
+
+echo ''
+echo '===================='
+echo ''
+# objects of -jit, -c and -shared can be cached across runs;
+#   the second run finds the object and skips the IR generation and the backend
+output/bin/calc -c -O2 -cache-dir ./output/cache -cache-stats "with a,b: a*b+1" -o ./output/bin/calc.cached.o
+output/bin/calc -c -O2 -cache-dir ./output/cache -cache-stats "with a, b: (a*b) + 1" -o ./output/bin/calc.cached.o
+
+
+echo ''
+echo '===================='
+echo ''
+# a long-lived compile server: each request is a frame "<length>\n<payload>",
+#   the payload is "eval <values>\n<expression>" or "compile\n<expression>"
+#   with -socket=<path>, clients connect to a Unix domain socket instead
+printf '22\neval 3 4\nwith a,b: a*b' | output/bin/calc -serve -O2
+#   an expression is interpreted until it has been evaluated -jit-threshold times, then it's compiled
+printf '22\neval 3 4\nwith a,b: a*b' | output/bin/calc -serve -O2 -jit-threshold=0
+#   the boundaries of int32_t are numbers like any other, in the input and as folded constants:
+#   both answers are "ok -2147483647", "ok -2147483648" (the arithmetic wraps around)
+printf '39\neval 1 0\nwith b,c: (b*2)+(2147483647+c)33\neval 0\nwith a: a+(0-2147483647-1)' \
+    | output/bin/calc -serve -O2
+printf '39\neval 1 0\nwith b,c: (b*2)+(2147483647+c)33\neval 0\nwith a: a+(0-2147483647-1)' \
+    | output/bin/calc -serve -O2 -jit-threshold=0
+
+
+echo ''
+echo '===================='
+echo ''
+# where the time goes: -time-phases prints a report of the phases and passes to stderr,
+#   -time-trace writes a Chrome trace (chrome://tracing or https://ui.perfetto.dev)
+output/bin/calc -c -O2 -time-phases "with a,b: a*b+1" -o ./output/bin/calc.timed.o
+output/bin/calc -c -O2 -time-trace=./output/calc.trace.json "with a,b: a*b+1" -o ./output/bin/calc.timed.o
+#   -mem-stats prints the allocations of each phase, the arena high-water marks and the peak RSS,
+#   -mem-stats-json=<file> writes the same as JSON
+output/bin/calc -c -O2 -mem-stats "with a,b: a*b+1" -o ./output/bin/calc.timed.o
+
+
+echo ''
+echo '===================='
+echo ''
+# many named formulas in one shared library, with a C header and a table to look them up by name
+printf 'revenue = with price,qty: price*qty\nmargin = with a,b: (a-b)/b\n' > ./output/formulas.calc
+output/bin/calc -f ./output/formulas.calc -bundle -O2 -o ./output/bin/libformulas.so
+#   a program opens it with the runtime in rtcalc_bundle.c, see rtcalc_bundle.h
+cat ./output/bin/libformulas.h
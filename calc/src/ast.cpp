@@ -0,0 +1,73 @@
+#include "ast.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Twine.h"
+#include <memory>
+
+uint32_t ASTContext::getSymbol(llvm::StringRef name) {
+    auto res = symbol_ids_.insert({name, getNumSymbols()});
+    if (res.second) {
+        symbols_.push_back(res.first->getKey());
+        idents_.push_back(nullptr);
+    }
+    return res.first->getValue();
+}
+
+Factor *ASTContext::getIdent(llvm::StringRef name) {
+    uint32_t symbol = getSymbol(name);
+    Factor *&node = idents_[symbol];
+    if (!node) {
+        node = new (alloc_) Factor(symbols_[symbol], symbol);
+        ++num_nodes_;
+    }
+    return node;
+}
+
+Factor *ASTContext::getNumber(llvm::StringRef text, int32_t value) {
+    Factor *&node = numbers_[value];
+    if (!node) {
+        node = new (alloc_) Factor(Factor::Number, text, value);
+        ++num_nodes_;
+    }
+    return node;
+}
+
+Factor *ASTContext::getNumber(int32_t value) {
+    auto it = numbers_.find(value);
+    if (it != numbers_.end())
+        return it->second;
+    // the text is only needed for messages, it is created in the arena
+    llvm::SmallString<16> text;
+    return getNumber(saver_.save(llvm::Twine(value).toStringRef(text)), value);
+}
+
+BinaryOp *ASTContext::getBinaryOp(BinaryOp::Operator op, Expr *left, Expr *right) {
+    BinaryOp *&node = binary_ops_[std::make_tuple(unsigned(op), left, right)];
+    if (!node) {
+        node = new (alloc_) BinaryOp(op, left, right);
+        ++num_nodes_;
+    }
+    return node;
+}
+
+WithDecl *ASTContext::createWithDecl(llvm::ArrayRef<llvm::StringRef> vars, Expr *e) {
+    // the arrays are stored in the arena, next to the node; the names are the copies kept by the symbol table
+    llvm::StringRef *names = alloc_.Allocate<llvm::StringRef>(vars.size());
+    uint32_t *symbols = alloc_.Allocate<uint32_t>(vars.size());
+    for (size_t i = 0, n = vars.size(); i != n; ++i) {
+        symbols[i] = getSymbol(vars[i]);
+        names[i] = symbols_[symbols[i]];
+    }
+    ++num_nodes_;
+    return new (alloc_) WithDecl(llvm::makeArrayRef(names, vars.size()),
+                                 llvm::makeArrayRef(symbols, vars.size()), e);
+}
+
+void ASTContext::reset() {
+    symbol_ids_.clear();
+    symbols_.clear();
+    idents_.clear();
+    numbers_.clear();
+    binary_ops_.clear();
+    num_nodes_ = 0;
+    alloc_.Reset();
+}
@@ -1,8 +1,20 @@
 #pragma once
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 class AST;
 class Expr;
@@ -10,33 +22,48 @@ class Factor;
 class BinaryOp;
 class WithDecl;
 
-class ASTVisitor {
-// The visitor pattern needs to know each class it must visit. 
-// Because each class also refers to the visitor, 
-//     we declare all the classes at the top of the file. 
-// Note that the visit() methods for AST and Expr have a default implementation, which does nothing.
-public:
-    virtual void visit(AST &) {};
-    virtual void visit(Expr &) {};
-    virtual void visit(Factor &) = 0;
-    virtual void visit(BinaryOp &) = 0;
-    virtual void visit(WithDecl &) = 0;
-};
-
 // The AST class is the root of the hierarchy
+// Each node carries a kind tag, which is set by the constructor of the concrete class.
+// Together with the classof() methods this gives LLVM-style RTTI (isa<>, cast<>, dyn_cast<>),
+//     and the visitors dispatch on the tag with a switch (see ASTVisitorBase below).
+// There are no virtual functions, so the nodes don't need a vtable.
 class AST {
 public:
-    virtual ~AST() {}
-    virtual void accept(ASTVisitor &v) = 0;
+    enum ASTKind {
+        AK_Factor,
+        AK_BinaryOp,
+        AK_LastExpr = AK_BinaryOp,
+        AK_WithDecl
+    };
+
+private:
+    const ASTKind ast_kind_;
+
+protected:
+    AST(ASTKind kind) : ast_kind_(kind) {}
+
+public:
+    ASTKind getASTKind() const { return ast_kind_; }
+
+    template <typename Visitor>
+    void accept(Visitor &v) {
+        v.dispatch(*this);
+    }
 };
 
 // Expr is the root for the AST classes related to expressions
 class Expr : public AST {
+protected:
+    Expr(ASTKind kind) : AST(kind) {}
+
 public:
-    Expr() {}
+    static bool classof(const AST *node) {
+        return node->getASTKind() <= AK_LastExpr;
+    }
 };
 
 // The Factor class stores a number or the name of a variable
+// A variable also has the dense ID of its name in the symbol table of the ASTContext.
 class Factor : public Expr {
 public:
     enum ValueKind { Ident, Number };
@@ -44,13 +71,22 @@ public:
 private:
     ValueKind kind_;
     llvm::StringRef val_;
+    union {
+        int32_t number_;  // the value of a number, decoded by the lexer
+        uint32_t symbol_; // the ID of a variable name
+    };
 
 public:
-    Factor(ValueKind kind, llvm::StringRef val) : kind_(kind), val_(val) {}
+    Factor(ValueKind kind, llvm::StringRef val, int32_t number = 0)
+        : Expr(AK_Factor), kind_(kind), val_(val), number_(number) {}
+    Factor(llvm::StringRef name, uint32_t symbol)
+        : Expr(AK_Factor), kind_(Ident), val_(name), symbol_(symbol) {}
     ValueKind getKind() { return kind_; }
     llvm::StringRef getVal() { return val_; }
-    virtual void accept(ASTVisitor &v) override {
-        v.visit(*this);
+    int32_t getNumber() { return number_; }
+    uint32_t getSymbol() { return symbol_; }
+    static bool classof(const AST *node) {
+        return node->getASTKind() == AK_Factor;
     }
 };
 
@@ -77,40 +113,165 @@ private:
 
 public:
     BinaryOp(Operator op, Expr *l, Expr *r)
-        : op_(op), left_(l), right_(r) {}
+        : Expr(AK_BinaryOp), left_(l), right_(r), op_(op) {}
     Expr *getLeft() { return left_; }
     Expr *getRight() { return right_; }
     Operator getOperator() { return op_; }
-    virtual void accept(ASTVisitor &v) override {
-        v.visit(*this);
+    static bool classof(const AST *node) {
+        return node->getASTKind() == AK_BinaryOp;
     }
 };
 
 
 // WithDecl stores the declared variables and the expression
+// The names and their symbol IDs are kept in arrays allocated by ASTContext, like the node itself.
 class WithDecl : public AST {
-    using VarVector = llvm::SmallVector<llvm::StringRef, 8>;
+    using VarVector = llvm::ArrayRef<llvm::StringRef>;
+    using SymbolVector = llvm::ArrayRef<uint32_t>;
     VarVector vars_;
+    SymbolVector symbols_;
     Expr *e_;
 
 public:
-    WithDecl(llvm::SmallVector<llvm::StringRef,8> vars, Expr *e)
-        : vars_(vars), e_(e) 
-    {
-        // llvm::outs() << "WithDecl: " << "\n";
-        for (auto itr = vars.begin(); itr < vars.end(); itr++) {
-            // llvm::outs() << "    " << *itr << "\n";
+    WithDecl(VarVector vars, SymbolVector symbols, Expr *e)
+        : AST(AK_WithDecl), vars_(vars), symbols_(symbols), e_(e) {}
+    VarVector::iterator begin() { return vars_.begin(); }
+    VarVector::iterator end() { return vars_.end(); }
+    VarVector getVars() { return vars_; }
+    // symbols_[i] is the ID of vars_[i]
+    SymbolVector getSymbols() { return symbols_; }
+    Expr *getExpr() { return e_; }
+    static bool classof(const AST *node) {
+        return node->getASTKind() == AK_WithDecl;
+    }
+};
+
+
+// The visitor pattern needs to know each class it must visit.
+// Instead of virtual accept() and visit() methods (two indirect calls per node),
+//     the visitors derive from ASTVisitorBase<Derived> (CRTP)
+//     and dispatch() switches over the kind tag.
+// The target of each call is known at compile time, so the visit() bodies can be inlined.
+// A derived class must implement visit(Factor &), visit(BinaryOp &) and visit(WithDecl &).
+//
+// Expressions are walked in post-order without recursion (see walkPostOrder()):
+//     visit(BinaryOp &) is called after both operands have been visited,
+//     and must not visit the operands itself.
+//     It finds their results in whatever per-node table the derived class keeps.
+// The nesting depth of an expression is therefore only limited by memory.
+template <typename Derived>
+class ASTVisitorBase {
+    Derived &derived() { return *static_cast<Derived *>(this); }
+
+public:
+    // Visits a whole tree.
+    // A WithDecl node is visited first, its visit() continues with walkPostOrder() on the expression.
+    void traverse(AST &tree) {
+        if (auto *e = llvm::dyn_cast<Expr>(&tree))
+            walkPostOrder(e);
+        else
+            dispatch(tree);
+    }
+
+    // Visits each distinct node of the expression once, the operands before the operator.
+    // The root is visited last.
+    void walkPostOrder(Expr *root) {
+        // the second member is true once the operands of the node are on the stack
+        llvm::SmallVector<std::pair<Expr *, bool>, 64> stack;
+        llvm::SmallPtrSet<Expr *, 32> visited;
+        stack.push_back({root, false});
+        while (!stack.empty()) {
+            Expr *e = stack.back().first;
+            if (visited.count(e)) {
+                stack.pop_back();
+                continue;
+            }
+            auto *op = llvm::dyn_cast<BinaryOp>(e);
+            if (op && !stack.back().second) {
+                stack.back().second = true;
+                // the left operand is on top, so it is visited first
+                if (op->getRight())
+                    stack.push_back({op->getRight(), false});
+                if (op->getLeft())
+                    stack.push_back({op->getLeft(), false});
+                continue;
+            }
+            stack.pop_back();
+            visited.insert(e);
+            dispatch(*e);
         }
     }
-    VarVector::const_iterator begin() {return vars_.begin(); }
-    VarVector::const_iterator end() { return vars_.end(); }
-    Expr *getExpr() { return e_; }
-    virtual void accept(ASTVisitor &v) override {
-        v.visit(*this);
+
+    void dispatch(AST &node) {
+        switch (node.getASTKind()) {
+            case AST::AK_Factor:
+                return derived().visit(llvm::cast<Factor>(node));
+            case AST::AK_BinaryOp:
+                return derived().visit(llvm::cast<BinaryOp>(node));
+            case AST::AK_WithDecl:
+                return derived().visit(llvm::cast<WithDecl>(node));
+        }
+        llvm_unreachable("unknown AST node kind");
     }
 };
 
 
+// ASTContext creates and owns all nodes of a tree, it is the state of one parse session.
+// The nodes are allocated from a bump-pointer arena: creating a node is a pointer increment,
+//     and the whole tree is released at once when the context is reset or destroyed.
+//     No destructors are run, so the nodes must not own any memory of their own.
+// Factor and BinaryOp nodes are hash-consed: a node with the same kind and text,
+//     or the same operator and operands, is created only once and then shared.
+// Because the operands are themselves unique, comparing the pointers is enough,
+//     and machine-generated input like (a*b+c)/(a*b+c-1) becomes a DAG
+//     which grows with the number of distinct subexpressions instead of the input length.
+//
+// The context is also the symbol table: each distinct variable name gets a dense ID, 0, 1, 2, ...
+// The name is hashed once, when the parser meets it.
+// The later phases index flat arrays with the ID instead of looking up the name again.
+class ASTContext {
+    llvm::BumpPtrAllocator alloc_;
+    llvm::StringSaver saver_; // stores the text of numbers which are not from the input
+    size_t num_nodes_ = 0;
+
+    llvm::StringMap<uint32_t> symbol_ids_;
+    std::vector<llvm::StringRef> symbols_; // the name of each ID, owned by symbol_ids_
+    std::vector<Factor *> idents_;         // the node of each ID, created on first use
+    // By value, so 007 and 7 are the same node.
+    // The key is widened: DenseMap reserves the largest and the smallest int32_t as its empty and
+    //     tombstone keys, and both are valid numbers (2147483647, or a folded constant).
+    llvm::DenseMap<int64_t, Factor *> numbers_;
+    llvm::DenseMap<std::tuple<unsigned, Expr *, Expr *>, BinaryOp *> binary_ops_;
+
+public:
+    ASTContext() : saver_(alloc_) {}
+    ASTContext(const ASTContext &) = delete;
+    ASTContext &operator=(const ASTContext &) = delete;
+
+    // returns the ID of the name, a new name gets the next free ID
+    uint32_t getSymbol(llvm::StringRef name);
+    llvm::StringRef getSymbolName(uint32_t symbol) const { return symbols_[symbol]; }
+    // the IDs are 0 .. getNumSymbols()-1
+    uint32_t getNumSymbols() const { return static_cast<uint32_t>(symbols_.size()); }
+
+    Factor *getIdent(llvm::StringRef name);
+    // a number from the input, with the value decoded by the lexer
+    Factor *getNumber(llvm::StringRef text, int32_t value);
+    // a number computed by the compiler, e.g. by constant folding
+    Factor *getNumber(int32_t value);
+    BinaryOp *getBinaryOp(BinaryOp::Operator op, Expr *left, Expr *right);
+    WithDecl *createWithDecl(llvm::ArrayRef<llvm::StringRef> vars, Expr *e);
+
+    // releases all nodes, the context can then be used for the next tree
+    void reset();
+
+    // the number of distinct nodes
+    size_t size() const { return num_nodes_; }
+    // the memory used by the arena
+    size_t getBytesAllocated() const { return alloc_.getBytesAllocated(); }
+};
+
+
 // The AST is constructed during parsing.
 
 // The semantic analysis checks that the tree adheres to the meaning of the language 
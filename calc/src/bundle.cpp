@@ -0,0 +1,246 @@
+#include "bundle.h"
+#include "emitter.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+using namespace llvm;
+
+uint32_t BundleWriter::hash(StringRef name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+namespace {
+
+// Hash and displace: the names are put into buckets by their hash with seed 0,
+//     then, the largest buckets first, each bucket gets the first seed
+//     which puts all its names into slots that are still free.
+// With about 4 names per bucket, a seed is found after a few tries even for the last buckets.
+// Returns false if some bucket finds no seed, which doesn't happen in practice.
+bool buildPerfectHash(ArrayRef<BundleWriter::Formula> formulas, std::vector<uint32_t> &seeds,
+                      std::vector<uint32_t> &slots) {
+    uint32_t n = formulas.size();
+    uint32_t num_buckets = std::max<uint32_t>(1, (n + 3) / 4);
+    std::vector<std::vector<uint32_t>> buckets(num_buckets);
+    for (uint32_t i = 0; i != n; ++i)
+        buckets[BundleWriter::hash(formulas[i].name, 0) % num_buckets].push_back(i);
+
+    std::vector<uint32_t> order(num_buckets);
+    for (uint32_t b = 0; b != num_buckets; ++b)
+        order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    seeds.assign(num_buckets, 0);
+    slots.assign(n, 0);
+    std::vector<bool> used(n, false);
+    std::vector<uint32_t> taken;
+    for (uint32_t b : order) {
+        if (buckets[b].empty())
+            break;
+        bool found = false;
+        for (uint32_t seed = 1; seed != (1u << 24) && !found; ++seed) {
+            taken.clear();
+            found = true;
+            for (uint32_t i : buckets[b]) {
+                uint32_t slot = BundleWriter::hash(formulas[i].name, seed) % n;
+                if (used[slot] || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    found = false;
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (found) {
+                seeds[b] = seed;
+                for (size_t k = 0; k != taken.size(); ++k) {
+                    used[taken[k]] = true;
+                    slots[taken[k]] = buckets[b][k];
+                }
+            }
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+// the name of the library without "lib" and the extension, as a C identifier in upper case
+std::string macroPrefix(StringRef library) {
+    StringRef stem = sys::path::stem(library);
+    stem.consume_front("lib");
+    std::string prefix;
+    for (char c : stem)
+        prefix += isAlnum(c) ? toUpper(c) : '_';
+    if (prefix.empty() || isDigit(prefix[0]))
+        prefix.insert(prefix.begin(), '_');
+    return prefix;
+}
+
+} // namespace
+
+bool BundleWriter::writeTable(ArrayRef<Formula> formulas, StringRef file_name) {
+    std::vector<uint32_t> seeds, slots;
+    if (!buildPerfectHash(formulas, seeds, slots)) {
+        errs() << "calc: no perfect hash found for the names of the formulas\n";
+        return true;
+    }
+
+    std::unique_ptr<ObjectEmitter> emitter = ObjectEmitter::create(/*pic*/true, opt_level_);
+    if (!emitter)
+        return true;
+    LLVMContext ctx;
+    Module m("calc.bundle", ctx);
+    emitter->prepare(m);
+
+    Type *int32_ty = Type::getInt32Ty(ctx);
+    Type *int64_ty = Type::getInt64Ty(ctx);
+    StructType *entry_ty = StructType::get(ctx, {int32_ty, int32_ty, int32_ty}, /*isPacked*/true);
+
+    std::string names;
+    for (const Formula &f : formulas) {
+        names += f.name;
+        names += '\0';
+    }
+    uint32_t n = formulas.size();
+    StructType *table_ty = StructType::get(ctx, {
+        ArrayType::get(int32_ty, 4),
+        ArrayType::get(entry_ty, n),
+        ArrayType::get(int32_ty, seeds.size()),
+        ArrayType::get(int32_ty, n),
+        ArrayType::get(Type::getInt8Ty(ctx), names.size()),
+    }, /*isPacked*/true);
+
+    // Protected: the table is exported, but the references from inside the library are resolved
+    //     by the linker, like those to the hidden functions.
+    auto *table = new GlobalVariable(m, table_ty, /*isConstant*/true, GlobalValue::ExternalLinkage,
+                                     nullptr, "calc_bundle_table");
+    table->setVisibility(GlobalValue::ProtectedVisibility);
+    table->setDSOLocal(true);
+    table->setAlignment(Align(4));
+
+    // the functions are defined in the objects of FileCompiler
+    FunctionType *fn_ty = FunctionType::get(int32_ty, {PointerType::getUnqual(int32_ty)}, false);
+    Constant *table_addr = ConstantExpr::getPtrToInt(table, int64_ty);
+    std::vector<Constant *> entries;
+    entries.reserve(n);
+    uint32_t name_offset = 0;
+    for (const Formula &f : formulas) {
+        Function *fn = Function::Create(fn_ty, GlobalValue::ExternalLinkage, "calc_expr_" + Twine(f.index), m);
+        fn->setVisibility(GlobalValue::HiddenVisibility);
+        fn->setDSOLocal(true);
+        // the offset of the function from the table, a constant once the library is linked
+        Constant *offset = ConstantExpr::getTrunc(
+            ConstantExpr::getSub(ConstantExpr::getPtrToInt(fn, int64_ty), table_addr), int32_ty);
+        entries.push_back(ConstantStruct::get(entry_ty, {ConstantInt::get(int32_ty, name_offset), offset,
+                                                         ConstantInt::get(int32_ty, f.num_vars)}));
+        name_offset += f.name.size() + 1;
+    }
+
+    auto u32Array = [&](ArrayRef<uint32_t> values) {
+        std::vector<Constant *> elts;
+        elts.reserve(values.size());
+        for (uint32_t v : values)
+            elts.push_back(ConstantInt::get(int32_ty, v));
+        return ConstantArray::get(ArrayType::get(int32_ty, values.size()), elts);
+    };
+    uint32_t header[] = {Magic, Version, n, uint32_t(seeds.size())};
+    table->setInitializer(ConstantStruct::get(table_ty, {
+        u32Array(header),
+        ConstantArray::get(ArrayType::get(entry_ty, n), entries),
+        u32Array(seeds),
+        u32Array(slots),
+        ConstantDataArray::getString(ctx, names, /*AddNull*/false),
+    }));
+
+    return emitter->emit(m, file_name);
+}
+
+bool BundleWriter::writeHeader(ArrayRef<Formula> formulas, StringRef file_name, StringRef library) {
+    std::error_code ec;
+    raw_fd_ostream os(file_name, ec, sys::fs::OF_Text);
+    if (ec) {
+        errs() << "calc: could not open " << file_name << ": " << ec.message() << "\n";
+        return true;
+    }
+    std::string prefix = macroPrefix(library);
+    os << "// generated by calc -bundle, the formulas of " << sys::path::filename(library) << "\n"
+       << "// open the library with calc_bundle_open() and find a formula with calc_bundle_lookup()\n\n"
+       << "#ifndef " << prefix << "_BUNDLE_H\n"
+       << "#define " << prefix << "_BUNDLE_H\n\n"
+       << "#include \"rtcalc_bundle.h\"\n\n"
+       << "#define " << prefix << "_NUM_FORMULAS " << formulas.size() << "\n\n"
+       << "// the formulas sorted by name, the index for calc_bundle_get() and the number of variables\n";
+    for (size_t i = 0; i != formulas.size(); ++i) {
+        const Formula &f = formulas[i];
+        if (!f.vars.empty())
+            os << "// " << f.name << ": with " << f.vars << "\n";
+        os << "#define " << prefix << "_" << f.name << "_INDEX " << i << "\n"
+           << "#define " << prefix << "_" << f.name << "_NUM_VARS " << f.num_vars << "\n";
+    }
+    os << "\n#endif\n";
+    return false;
+}
+
+bool BundleWriter::write(std::vector<Formula> formulas, ArrayRef<std::string> objects, StringRef library) {
+    std::sort(formulas.begin(), formulas.end(), [](const Formula &a, const Formula &b) {
+        return a.name < b.name;
+    });
+    for (size_t i = 1; i < formulas.size(); ++i) {
+        if (formulas[i].name == formulas[i - 1].name) {
+            errs() << "calc: the formula '" << formulas[i].name << "' is defined more than once\n";
+            return true;
+        }
+    }
+
+    SmallString<128> stem(library);
+    sys::path::replace_extension(stem, "");
+    std::string table_file = (stem + ".table.o").str();
+    std::string header_file = (stem + ".h").str();
+    if (writeTable(formulas, table_file) || writeHeader(formulas, header_file, library))
+        return true;
+
+    // LLVM has no linker of its own, the one of the system C compiler links the library
+    ErrorOr<std::string> cc = sys::findProgramByName("cc");
+    if (!cc) {
+        errs() << "calc: no C compiler (cc) found to link " << library
+               << ", the objects are left in place\n";
+        return true;
+    }
+    std::vector<StringRef> args = {*cc, "-shared", "-o", library};
+    for (const std::string &obj : objects)
+        args.push_back(obj);
+    args.push_back(table_file);
+    std::string err_msg;
+    if (sys::ExecuteAndWait(*cc, args, None, {}, 0, 0, &err_msg) != 0) {
+        errs() << "calc: linking " << library << " failed";
+        if (!err_msg.empty())
+            errs() << ": " << err_msg;
+        errs() << "\n";
+        return true;
+    }
+    for (const std::string &obj : objects)
+        sys::fs::remove(obj);
+    sys::fs::remove(table_file);
+    return false;
+}
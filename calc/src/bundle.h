@@ -0,0 +1,55 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Builds an ahead-of-time bundle: the formulas of a file compiled by FileCompiler,
+//     linked into one shared library with a table to find them by name at run time.
+//
+//     calc -f formulas.calc -bundle -O2 -o libformulas.so
+//
+// A line of the file may name its formula, "revenue = with price,qty: price*qty",
+//     a formula without a name is called expr_<i> after its position in the file.
+// The bundle consists of
+//     libformulas.so  the functions of FileCompiler and the table calc_bundle_table
+//     libformulas.h   the names and the numbers of variables of the formulas, as C macros
+// and is opened with the runtime in rtcalc_bundle.c.
+//
+// The table holds the formulas sorted by name, and a minimal perfect hash of the names
+//     (hash and displace: a seed per bucket of names, chosen so that no two names collide).
+// It refers to the functions and the names by their offsets from the table itself,
+//     which the linker resolves, so loading the library needs no relocation per formula:
+//     the cost of dlopen() doesn't grow with the number of formulas.
+// The functions are hidden, the table is the only symbol the library exports.
+class BundleWriter {
+public:
+    struct Formula {
+        std::string name;
+        size_t index;      // the function is calc_expr_<index>
+        uint32_t num_vars;
+        std::string vars;  // the declared variables, for the header
+    };
+
+    // the layout of the table, shared with rtcalc_bundle.h
+    static const uint32_t Magic = 0x424c4143; // "CALB"
+    static const uint32_t Version = 1;
+
+    // the hash of the names, the same function as calc_bundle_hash() in rtcalc_bundle.c
+    static uint32_t hash(llvm::StringRef name, uint32_t seed);
+
+private:
+    unsigned opt_level_;
+
+    bool writeTable(llvm::ArrayRef<Formula> formulas, llvm::StringRef file_name);
+    bool writeHeader(llvm::ArrayRef<Formula> formulas, llvm::StringRef file_name, llvm::StringRef library);
+
+public:
+    BundleWriter(unsigned opt_level) : opt_level_(opt_level) {}
+
+    // Writes the table and the header, and links the objects with the table into the library.
+    // The objects are removed once the library is linked. Returns true if an error occurred.
+    bool write(std::vector<Formula> formulas, llvm::ArrayRef<std::string> objects, llvm::StringRef library);
+};
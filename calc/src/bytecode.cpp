@@ -0,0 +1,163 @@
+#include "bytecode.h"
+#include "llvm/ADT/DenseMap.h"
+#include <cstring>
+
+namespace {
+
+// Translates the tree in one post-order walk.
+// The registers of the constants and the operators are only known once the walk is done,
+//     so they are numbered separately first and moved behind the variables in finish().
+class BytecodeCompiler : public ASTVisitorBase<BytecodeCompiler> {
+    // a register while compiling: the kind is in the top two bits
+    enum : uint32_t { VarReg = 0u << 30, ConstReg = 1u << 30, TempReg = 2u << 30, KindMask = 3u << 30 };
+
+    std::vector<uint32_t> var_regs_; // by symbol ID
+    uint32_t num_vars_ = 0;
+    std::vector<int32_t> consts_;
+    uint32_t num_temps_ = 0;
+    llvm::DenseMap<Expr *, uint32_t> regs_;
+
+    struct PendingInsn {
+        Bytecode::Opcode op;
+        uint32_t dst, a, b;
+    };
+    std::vector<PendingInsn> code_;
+    uint32_t result_ = 0;
+
+public:
+    void visit(WithDecl &node) {
+        llvm::ArrayRef<uint32_t> symbols = node.getSymbols();
+        num_vars_ = symbols.size();
+        for (uint32_t i = 0; i != num_vars_; ++i) {
+            if (symbols[i] >= var_regs_.size())
+                var_regs_.resize(symbols[i] + 1);
+            var_regs_[symbols[i]] = VarReg | i;
+        }
+        walkPostOrder(node.getExpr());
+    }
+
+    void visit(Factor &node) {
+        if (node.getKind() == Factor::Ident) {
+            result_ = var_regs_[node.getSymbol()];
+        } else {
+            // the numbers are hash-consed, so each value gets one register
+            result_ = ConstReg | uint32_t(consts_.size());
+            consts_.push_back(node.getNumber());
+        }
+        regs_[&node] = result_;
+    }
+
+    void visit(BinaryOp &node) {
+        static const Bytecode::Opcode opcodes[] = {Bytecode::Add, Bytecode::Sub, Bytecode::Mul, Bytecode::Div};
+        result_ = TempReg | num_temps_++;
+        code_.push_back({opcodes[node.getOperator()], result_,
+                         regs_.lookup(node.getLeft()), regs_.lookup(node.getRight())});
+        regs_[&node] = result_;
+    }
+
+    // moves the registers into their final order, returns false if there are too many
+    bool finish(std::vector<Bytecode::Insn> &code, std::vector<int32_t> &consts,
+                uint32_t &num_vars, uint32_t &num_regs) {
+        uint64_t total = uint64_t(num_vars_) + consts_.size() + num_temps_;
+        if (total > Bytecode::MaxRegs)
+            return false;
+        uint32_t const_base = num_vars_;
+        uint32_t temp_base = const_base + consts_.size();
+        auto final = [&](uint32_t reg) -> uint16_t {
+            uint32_t index = reg & ~KindMask;
+            switch (reg & KindMask) {
+                case ConstReg: return uint16_t(const_base + index);
+                case TempReg: return uint16_t(temp_base + index);
+                default: return uint16_t(index);
+            }
+        };
+        code.reserve(code_.size() + 1);
+        for (const PendingInsn &i : code_)
+            code.push_back({i.op, final(i.dst), final(i.a), final(i.b)});
+        code.push_back({Bytecode::Ret, 0, final(result_), 0});
+        consts = std::move(consts_);
+        num_vars = num_vars_;
+        num_regs = uint32_t(total);
+        return true;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<Bytecode> Bytecode::compile(AST *tree) {
+    BytecodeCompiler compiler;
+    compiler.traverse(*tree);
+    std::unique_ptr<Bytecode> bc(new Bytecode());
+    if (!compiler.finish(bc->code_, bc->consts_, bc->num_vars_, bc->num_regs_))
+        return nullptr;
+    return bc;
+}
+
+// the operations on int32_t with wrap-around, computed on uint32_t to avoid undefined behavior
+static inline int32_t wrapAdd(int32_t x, int32_t y) { return int32_t(uint32_t(x) + uint32_t(y)); }
+static inline int32_t wrapSub(int32_t x, int32_t y) { return int32_t(uint32_t(x) - uint32_t(y)); }
+static inline int32_t wrapMul(int32_t x, int32_t y) { return int32_t(uint32_t(x) * uint32_t(y)); }
+static inline int32_t safeDiv(int32_t x, int32_t y) {
+    if (y == 0)
+        return 0;
+    if (y == -1)
+        return wrapSub(0, x);
+    return x / y;
+}
+
+int32_t Bytecode::run(const int32_t *vars) const {
+    // Small expressions keep their registers on the stack.
+    // The larger ones use a buffer of the thread, which only grows (up to MaxRegs registers),
+    //     so an evaluation doesn't allocate once the thread has seen the largest expression.
+    // The buffer is not shared: run() doesn't call itself.
+    int32_t small_regs[256];
+    int32_t *r = small_regs;
+    if (num_regs_ > 256) {
+        static thread_local std::vector<int32_t> big_regs;
+        if (big_regs.size() < num_regs_)
+            big_regs.resize(num_regs_);
+        r = big_regs.data();
+    }
+    std::memcpy(r, vars, num_vars_ * sizeof(int32_t));
+    if (!consts_.empty())
+        std::memcpy(r + num_vars_, consts_.data(), consts_.size() * sizeof(int32_t));
+
+    const Insn *pc = code_.data();
+#if defined(__GNUC__)
+    // Threaded dispatch: each handler jumps straight to the handler of the next instruction,
+    //     so every instruction has an indirect branch of its own, which predicts better
+    //     than the single one of a switch in a loop.
+    static const void *const handlers[] = {&&do_add, &&do_sub, &&do_mul, &&do_div, &&do_ret};
+#define DISPATCH() goto *handlers[pc->op]
+    DISPATCH();
+do_add:
+    r[pc->dst] = wrapAdd(r[pc->a], r[pc->b]);
+    ++pc;
+    DISPATCH();
+do_sub:
+    r[pc->dst] = wrapSub(r[pc->a], r[pc->b]);
+    ++pc;
+    DISPATCH();
+do_mul:
+    r[pc->dst] = wrapMul(r[pc->a], r[pc->b]);
+    ++pc;
+    DISPATCH();
+do_div:
+    r[pc->dst] = safeDiv(r[pc->a], r[pc->b]);
+    ++pc;
+    DISPATCH();
+do_ret:
+    return r[pc->a];
+#undef DISPATCH
+#else
+    for (;; ++pc) {
+        switch (pc->op) {
+            case Add: r[pc->dst] = wrapAdd(r[pc->a], r[pc->b]); break;
+            case Sub: r[pc->dst] = wrapSub(r[pc->a], r[pc->b]); break;
+            case Mul: r[pc->dst] = wrapMul(r[pc->a], r[pc->b]); break;
+            case Div: r[pc->dst] = safeDiv(r[pc->a], r[pc->b]); break;
+            case Ret: return r[pc->a];
+        }
+    }
+#endif
+}
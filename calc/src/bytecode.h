@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ast.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A compact register-based form of an expression, for the interpreter tier of the server.
+// Compiling an expression to bytecode takes microseconds instead of the milliseconds of LLVM,
+//     so an expression which is evaluated only a few times is never handed to the JIT.
+//
+// Each variable, each constant and each distinct operator node of the DAG has a register:
+//     first the variables, then the constants, then the results of the operators in post-order.
+// The variables and the constants are copied into their registers before the first instruction,
+//     so the instructions are only the operators and a final Ret.
+//
+// The arithmetic is the same as in the safe code of CodeGen (see CodeGen::compileFunction()):
+//     overflow wraps around, x/0 is 0 and INT_MIN/-1 is INT_MIN,
+//     so an expression gives the same results before and after it is promoted to the JIT.
+class Bytecode {
+public:
+    enum Opcode : uint16_t { Add, Sub, Mul, Div, Ret };
+
+    // 8 bytes: the opcode, the destination and the two operand registers
+    struct Insn {
+        Opcode op;
+        uint16_t dst;
+        uint16_t a;
+        uint16_t b;
+    };
+
+    // the register numbers must fit in 16 bits
+    static const uint32_t MaxRegs = 65536;
+
+private:
+    std::vector<Insn> code_;
+    std::vector<int32_t> consts_;
+    uint32_t num_vars_ = 0;
+    uint32_t num_regs_ = 0;
+
+public:
+    // Returns nullptr if the expression needs more than MaxRegs registers,
+    //     such an expression goes straight to the JIT.
+    static std::unique_ptr<Bytecode> compile(AST *tree);
+
+    // evaluates the expression, vars holds getNumVars() values
+    int32_t run(const int32_t *vars) const;
+
+    uint32_t getNumVars() const { return num_vars_; }
+    uint32_t getNumRegs() const { return num_regs_; }
+    size_t size() const { return code_.size(); }
+};
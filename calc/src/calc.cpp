@@ -1,10 +1,27 @@
 // All the phases from the previous sections are glued together by the calc.cpp driver
 // We delegated the object code generation to the LLVM static compiler, llc
+// With --jit, the module is compiled and run in-process instead,
+// and with -c or -shared an object file is emitted directly
 
+#include "bundle.h"
 #include "code_gen.h"
+#include "const_fold.h"
+#include "emitter.h"
+#include "expr_cache.h"
+#include "file_compiler.h"
+#include "jit.h"
+#include "mem_stats.h"
+#include "multiversion.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "phase_timer.h"
 #include "sema.h"
+#include "server.h"
+#include "target_cpu.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -15,15 +32,358 @@ static llvm::cl::opt<std::string> Input(
     llvm::cl::init("")
 );
 
-int main(int argc, const char **argv) {
-    llvm::InitLLVM x(argc, argv); // initialize LLVM lib
-    llvm::cl::ParseCommandLineOptions(
-        argc, argv, "calc - the expression compiler\n");
+static llvm::cl::opt<std::string> InputFile(
+    "f",
+    llvm::cl::desc("Compile the expressions of a file, one per line or separated by ';'"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<unsigned> ChunkSize(
+    "chunk-size",
+    llvm::cl::desc("With -f, the number of expressions per module (default 1024)"),
+    llvm::cl::init(1024)
+);
+
+static llvm::cl::opt<unsigned> Threads(
+    "j",
+    llvm::cl::desc("With -f, compile the chunks on N threads (0: one per core)"),
+    llvm::cl::value_desc("N"),
+    llvm::cl::Prefix,
+    llvm::cl::init(1)
+);
+
+static llvm::cl::opt<bool> Jit(
+    "jit",
+    llvm::cl::desc("Run the expression in-process with the ORC JIT instead of printing IR"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> EmitObject(
+    "c",
+    llvm::cl::desc("Emit a native object file instead of printing IR"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> Shared(
+    "shared",
+    llvm::cl::desc("Emit a position independent object file, ready to be linked into a shared library"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> Bundle(
+    "bundle",
+    llvm::cl::desc("With -f, link the formulas into the shared library -o lib<name>.so, "
+                   "with a table to look them up by name and a C header (see BundleWriter)"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<std::string> Output(
+    "o",
+    llvm::cl::desc("Output file for -c, -shared and -bundle"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::init("calc.expr.o")
+);
+
+static llvm::cl::opt<bool> Batch(
+    "batch",
+    llvm::cl::desc("Generate the batch kernel calc_eval(cols, out, n) instead of main()"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> Fuse(
+    "fuse",
+    llvm::cl::desc("With -f and -batch, compile all the expressions of the file into one kernel "
+                   "calc_eval_fused, which reads each variable once for all of them"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<std::string> Mcpu(
+    "mcpu",
+    llvm::cl::desc("Tune the code for this CPU, 'native' for the one calc runs on (default: generic)"),
+    llvm::cl::value_desc("cpu"),
+    llvm::cl::init("generic")
+);
+
+static llvm::cl::opt<std::string> Mattr(
+    "mattr",
+    llvm::cl::desc("Enable or disable CPU features, e.g. +avx2,-fma"),
+    llvm::cl::value_desc("features"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> Multiversion(
+    "multiversion",
+    llvm::cl::desc("With -batch or -f, generate SSE2, AVX2 and AVX-512 variants of each function, "
+                   "the best one is picked when the program is loaded (see MultiVersion)"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> Pretokenize(
+    "pretokenize",
+    llvm::cl::desc("Lex the whole input into a token array before parsing"),
+    llvm::cl::init(false)
+);
+
+// -O0 .. -O3, like clang and opt
+static llvm::cl::opt<unsigned> OptLevel(
+    "O",
+    llvm::cl::desc("Optimization level (0-3)"),
+    llvm::cl::Prefix,
+    llvm::cl::init(0)
+);
+
+static llvm::cl::opt<std::string> Passes(
+    "passes",
+    llvm::cl::desc("Run a custom pass pipeline instead of the -O pipeline, in the syntax of opt -passes"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<std::string> CacheDir(
+    "cache-dir",
+    llvm::cl::desc("Cache the objects of -jit, -c, -shared and -serve in this directory"),
+    llvm::cl::value_desc("dir"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<unsigned> CacheSize(
+    "cache-size",
+    llvm::cl::desc("The size limit of the cache directory in MB (default 256)"),
+    llvm::cl::init(256)
+);
+
+static llvm::cl::opt<bool> CacheStats(
+    "cache-stats",
+    llvm::cl::desc("Print the hits and misses of the cache"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<bool> Serve(
+    "serve",
+    llvm::cl::desc("Run as a compile server, reading framed requests from stdin (see CalcServer)"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<std::string> Socket(
+    "socket",
+    llvm::cl::desc("With -serve, accept clients on this Unix domain socket instead of stdin"),
+    llvm::cl::value_desc("path"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> TimePhases(
+    "time-phases",
+    llvm::cl::desc("Time each phase of the compiler and each pass, the report is printed to stderr"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<std::string> TimeTrace(
+    "time-trace",
+    llvm::cl::desc("Write a Chrome trace of the phases and passes to this file"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<bool> MemStatsOpt(
+    "mem-stats",
+    llvm::cl::desc("Print the allocations of each phase, the arenas and the peak RSS to stderr"),
+    llvm::cl::init(false)
+);
+
+static llvm::cl::opt<std::string> MemStatsJSON(
+    "mem-stats-json",
+    llvm::cl::desc("Write the memory statistics of -mem-stats as JSON to this file"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::init("")
+);
+
+static llvm::cl::opt<uint64_t> JitThreshold(
+    "jit-threshold",
+    llvm::cl::desc("With -serve, interpret an expression until it has been evaluated this often, "
+                   "then compile it (default 1000, 0 compiles right away)"),
+    llvm::cl::init(1000)
+);
+
+static llvm::cl::opt<unsigned> ServeMaxExprs(
+    "serve-max-exprs",
+    llvm::cl::desc("With -serve, keep at most this many expressions, the least recently used go first "
+                   "(default 10000)"),
+    llvm::cl::init(10000)
+);
+
+// the CPU of -mcpu and -mattr
+static TargetCPU getTargetCPU() {
+    return TargetCPU::get(Mcpu, Mattr);
+}
+
+// builds the module for the tree, in the form selected by -batch
+static std::unique_ptr<llvm::Module> generate(AST *tree, llvm::LLVMContext &ctx) {
+    PhaseTimer timer("irgen", "IR construction");
+    CodeGen code_generator(getTargetCPU());
+    if (!Batch)
+        return code_generator.compile(tree, ctx);
+    std::unique_ptr<llvm::Module> m = code_generator.compileBatch(tree, ctx);
+    if (Multiversion)
+        MultiVersion::apply(*m, {m->getFunction("calc_eval")});
+    return m;
+}
+
+// everything besides the tree that goes into the key of the cache
+// The CPU of -mcpu and -mattr is on the functions as well (see TargetCPU::apply()),
+//     so it counts even where tm doesn't know it, like the target machine of the JIT.
+static std::string getCacheConfig(llvm::StringRef output, const llvm::TargetMachine &tm) {
+    TargetCPU cpu = getTargetCPU();
+    return (output + (Batch ? " batch" : " main") + (Multiversion ? " multiversion" : "") +
+            " -O" + llvm::Twine(OptLevel) + " -passes=" + Passes +
+            " -mcpu=" + cpu.cpu + " -mattr=" + cpu.features + " " + ExprCache::describeTarget(tm)).str();
+}
+
+// hands the module to LLJIT and runs the generated main()
+// With a cache, a hit skips the code generation, the optimizer and the backend.
+static int runJIT(AST *tree, ExprCache *cache) {
+    llvm::ExitOnError exit_on_err("calc: ");
+    auto jit = exit_on_err(CalcJIT::create(OptLevel, cache));
+    std::string key;
+    if (cache) {
+        key = ExprCache::computeKey(tree, getCacheConfig("jit", jit->getTargetMachine()));
+        if (std::unique_ptr<llvm::MemoryBuffer> obj = cache->lookup(key)) {
+            exit_on_err(jit->addObject(std::move(obj)));
+            return exit_on_err(jit->runMain());
+        }
+    }
+
+    // the context is heap allocated, because the JIT takes ownership of it
+    auto ctx = std::make_unique<llvm::LLVMContext>();
+    std::unique_ptr<llvm::Module> m = generate(tree, *ctx);
+    // the JIT hands the compiled object to the cache under this key
+    if (cache)
+        ExprCache::setModuleKey(*m, key);
+    m->setDataLayout(jit->getDataLayout());
+    m->setTargetTriple(jit->getTargetMachine().getTargetTriple().getTriple());
+    if (Optimizer(OptLevel, Passes).run(*m, &jit->getTargetMachine()))
+        return 1;
+    exit_on_err(jit->addModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(ctx))));
+    return exit_on_err(jit->runMain());
+}
+
+static bool writeFile(llvm::StringRef file_name, llvm::StringRef data) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out(file_name, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        llvm::errs() << "calc: could not open " << file_name << ": " << ec.message() << "\n";
+        return true;
+    }
+    out << data;
+    return false;
+}
 
+// -c and -shared
+// With a cache, a hit skips the code generation, the optimizer and the backend.
+static int emitObject(AST *tree, ExprCache *cache) {
+    std::unique_ptr<ObjectEmitter> emitter = ObjectEmitter::create(Shared, OptLevel, getTargetCPU());
+    if (!emitter)
+        return 1;
+    std::string key;
+    if (cache) {
+        key = ExprCache::computeKey(tree, getCacheConfig(Shared ? "pic" : "obj", emitter->getTargetMachine()));
+        if (std::unique_ptr<llvm::MemoryBuffer> obj = cache->lookup(key))
+            return writeFile(Output, obj->getBuffer()) ? 1 : 0;
+    }
+
+    llvm::LLVMContext ctx;
+    std::unique_ptr<llvm::Module> m = generate(tree, ctx);
+    emitter->prepare(*m);
+    if (Optimizer(OptLevel, Passes).run(*m, &emitter->getTargetMachine()))
+        return 1;
+    if (!cache)
+        return emitter->emit(*m, Output) ? 1 : 0;
+
+    llvm::SmallVector<char, 0> obj;
+    if (emitter->emit(*m, obj))
+        return 1;
+    llvm::StringRef data(obj.data(), obj.size());
+    cache->store(key, data);
+    return writeFile(Output, data) ? 1 : 0;
+}
+
+// -serve: the targets, the JIT and the cache stay warm between the requests
+static int runServer() {
+    llvm::ExitOnError exit_on_err("calc: ");
+    auto server = exit_on_err(CalcServer::create(OptLevel, CacheDir, uint64_t(CacheSize) << 20, JitThreshold,
+                                                 ServeMaxExprs));
+    bool has_error = Socket.empty() ? server->serveStream(0, 1) : server->serveSocket(Socket);
+    if (CacheStats)
+        server->getCache().printStats(llvm::errs());
+    return has_error ? 1 : 0;
+}
+
+// -f: each expression of the file becomes a function calc_expr_<i>, see FileCompiler
+static int compileFile() {
+    if (Jit || (Batch && !Fuse)) {
+        llvm::errs() << "calc: -f can't be used with -jit, or with -batch without -fuse\n";
+        return 1;
+    }
+    if (Fuse && (!Batch || Bundle)) {
+        llvm::errs() << "calc: -fuse needs -batch, and can't be used with -bundle\n";
+        return 1;
+    }
+    if (ChunkSize == 0) {
+        llvm::errs() << "calc: -chunk-size must be at least 1\n";
+        return 1;
+    }
+    FileCompiler::Options opts;
+    opts.output_kind = Shared ? FileCompiler::SharedObject
+                     : EmitObject ? FileCompiler::Object
+                     : FileCompiler::IR;
+    opts.output = Output;
+    opts.opt_level = OptLevel;
+    opts.passes = Passes;
+    opts.chunk_size = ChunkSize;
+    opts.threads = Threads;
+    opts.target = getTargetCPU();
+    opts.multiversion = Multiversion;
+    opts.fuse = Fuse;
+    if (!Bundle)
+        return FileCompiler(opts).run(InputFile) ? 1 : 0;
+
+    // the objects of the chunks are named after the library and linked into it
+    llvm::StringRef library = Output;
+    if (!library.endswith(".so")) {
+        llvm::errs() << "calc: -bundle needs a shared library as output, e.g. -o libformulas.so\n";
+        return 1;
+    }
+    opts.output_kind = FileCompiler::SharedObject;
+    opts.output = (library.drop_back(3) + ".o").str();
+    opts.bundle = true;
+    FileCompiler compiler(opts);
+    if (compiler.run(InputFile))
+        return 1;
+    return BundleWriter(OptLevel).write(compiler.getFormulas(), compiler.getObjectFiles(), library) ? 1 : 0;
+}
+
+// compiles the expression given on the command line
+static int compileExpr() {
+    // The lexer normally runs on demand, interleaved with the parser.
+    // When the phases are timed, the tokens are produced first, so the two can be told apart.
+    bool pretokenize = Pretokenize || TimePhases || !TimeTrace.empty();
+
+    // owns the nodes of the tree
+    ASTContext ast_ctx;
     Lexer lex(Input);
-    Parser parser(lex);
+    TokenBuffer tokens;
+    if (pretokenize) {
+        PhaseTimer timer("lex", "Lexing");
+        if (lex.tokenize(tokens))
+            return 1;
+    }
+    Parser parser = pretokenize ? Parser(tokens, ast_ctx) : Parser(lex, ast_ctx);
     // The result of the parsing process is an AST
-    AST *tree = parser.parse();
+    AST *tree;
+    {
+        PhaseTimer timer("parse", "Parsing");
+        tree = parser.parse();
+    }
+    MemStats::noteArena("ast", ast_ctx.getBytesAllocated());
     
     // check if errors occurred after syntactical analysis
     if (!tree || parser.hasError()) {
@@ -31,12 +391,136 @@ int main(int argc, const char **argv) {
         return 1;
     }
     Sema semantic;
-    if (semantic.semantic(tree)) {
+    bool sema_error;
+    {
+        PhaseTimer timer("sema", "Semantic analysis");
+        sema_error = semantic.semantic(tree);
+    }
+    if (sema_error) {
         llvm::errs() << "Semantic errors occured\n";
         return 1;
     }
     
-    CodeGen code_generator;
-    code_generator.compile(tree);
+    // simplify the tree before any IR is built for it
+    {
+        PhaseTimer timer("fold", "Constant folding");
+        ConstFold folder(ast_ctx);
+        tree = folder.fold(tree);
+    }
+
+    if (Batch && Jit) {
+        llvm::errs() << "calc: -batch can't be used with -jit, the kernel has no main()\n";
+        return 1;
+    }
+    if (Fuse) {
+        llvm::errs() << "calc: -fuse needs a file of expressions, -f\n";
+        return 1;
+    }
+    if (Multiversion && !Batch) {
+        llvm::errs() << "calc: -multiversion needs -batch or -f, main() is run only once\n";
+        return 1;
+    }
+
+    if (Jit || EmitObject || Shared) {
+        // the cache holds objects, so it isn't used when the IR is printed
+        std::unique_ptr<ExprCache> cache;
+        if (!CacheDir.empty())
+            cache = std::make_unique<ExprCache>(CacheDir, uint64_t(CacheSize) << 20);
+        int res = Jit ? runJIT(tree, cache.get()) : emitObject(tree, cache.get());
+        if (cache && CacheStats)
+            cache->printStats(llvm::errs());
+        return res;
+    }
+
+    llvm::LLVMContext ctx;
+    std::unique_ptr<llvm::Module> m = generate(tree, ctx);
+
+    // The kernel is only worth looking at once the loop is vectorized,
+    //     and the vectorizer needs to know the vector registers of the target.
+    std::unique_ptr<ObjectEmitter> emitter;
+    if (Batch) {
+        emitter = ObjectEmitter::create(false, OptLevel, getTargetCPU());
+        if (!emitter)
+            return 1;
+        emitter->prepare(*m);
+    }
+    // without a target, only the target independent parts of the pipeline are effective
+    if (Optimizer(OptLevel, Passes).run(*m, emitter ? &emitter->getTargetMachine() : nullptr))
+        return 1;
+    m->print(llvm::outs(), nullptr);
     return 0;
 }
+
+int main(int argc, const char **argv) {
+    llvm::InitLLVM x(argc, argv); // initialize LLVM lib
+    llvm::cl::ParseCommandLineOptions(
+        argc, argv, "calc - the expression compiler\n");
+
+    if (OptLevel > 3) {
+        llvm::errs() << "calc: invalid optimization level -O" << OptLevel << "\n";
+        return 1;
+    }
+
+    if (Multiversion) {
+        if (!MultiVersion::isSupported()) {
+            llvm::errs() << "calc: -multiversion is only supported on x86-64\n";
+            return 1;
+        }
+        // each variant has a CPU of its own
+        if (Mcpu.getNumOccurrences() || !Mattr.empty()) {
+            llvm::errs() << "calc: -multiversion can't be used with -mcpu or -mattr\n";
+            return 1;
+        }
+        if (Jit || Serve) {
+            llvm::errs() << "calc: -multiversion can't be used with -jit or -serve\n";
+            return 1;
+        }
+    }
+
+    if (Serve) {
+        // the server never exits, so there would be no report
+        if (TimePhases || !TimeTrace.empty() || MemStatsOpt || !MemStatsJSON.empty()) {
+            llvm::errs() << "calc: -time-phases, -time-trace and -mem-stats can't be used with -serve\n";
+            return 1;
+        }
+        return runServer();
+    }
+    if (Optimizer::checkPipeline(Passes))
+        return 1;
+    // the timers can't be shared between threads, the trace can
+    if (TimePhases && !InputFile.empty() && Threads != 1) {
+        llvm::errs() << "calc: -time-phases can't be used with -j, only -time-trace can\n";
+        return 1;
+    }
+    if (TimePhases)
+        PhaseTimer::enableTimers();
+    if (!TimeTrace.empty())
+        PhaseTimer::startTrace();
+    bool mem_stats = MemStatsOpt || !MemStatsJSON.empty();
+    if (mem_stats)
+        MemStats::enable();
+
+    int res = InputFile.empty() ? compileExpr() : compileFile();
+
+    if (!TimeTrace.empty()) {
+        if (llvm::Error err = PhaseTimer::writeTrace(TimeTrace)) {
+            llvm::errs() << "calc: " << llvm::toString(std::move(err)) << "\n";
+            return 1;
+        }
+    }
+    if (mem_stats) {
+        MemStats::Report report = MemStats::take();
+        if (MemStatsOpt)
+            report.print(llvm::errs());
+        if (!MemStatsJSON.empty()) {
+            std::error_code ec;
+            llvm::raw_fd_ostream os(MemStatsJSON, ec);
+            if (ec) {
+                llvm::errs() << "calc: can't write " << MemStatsJSON << ": " << ec.message() << "\n";
+                return 1;
+            }
+            report.printJSON(os);
+        }
+    }
+    return res;
+}
@@ -1,8 +1,11 @@
 #include "code_gen.h"
-#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/raw_ostream.h"
+#include <vector>
 
 // the AST contains the information from semantic analysis phase, 
 //     the basic idea is to use a visitor to walk the AST
@@ -11,7 +14,7 @@ using namespace llvm;
 
 namespace {
 
-class ToIRVisitor : public ASTVisitor {
+class ToIRVisitor : public ASTVisitorBase<ToIRVisitor> {
 
     // Each compilation unit is represented in LLVM by the Module class 
     //     and the visitor has a pointer to the module call, m_
@@ -26,13 +29,27 @@ class ToIRVisitor : public ASTVisitor {
     Type *int32_ty_;
     Type *int8_ptr_ty_;
     Type *int8_ptr_ptr_ty_;
+    Type *int64_ty_;
     Constant *int32_zero_; 
     
     // current calculated value, which is updated through tree traversal
     Value *v_; 
     
-    // maps a variable name to the value that's returned by the calc_read() function
-    StringMap<Value *> name_map_;
+    // maps the symbol ID of a variable to the value that's returned by the calc_read() function
+    // The IDs are dense (see ASTContext), so this is a flat array instead of a map of names.
+    std::vector<Value *> symbol_values_;
+
+    // The value computed for each node.
+    // The tree is walked in post-order, so the values of the operands are here when a BinaryOp is visited.
+    // The tree is also a DAG, identical subexpressions are the same node (see ASTContext):
+    //     each node is lowered only once, later uses reuse the computed value.
+    // All code is emitted into one basic block, so the value dominates every use.
+    DenseMap<Expr *, Value *> values_;
+
+    // True if every input must give a defined result, as in a batch kernel:
+    //     divisions don't trap (see createSafeDiv()) and overflow wraps around (no nsw flags).
+    // The bytecode interpreter computes the same values (see Bytecode::run()).
+    bool safe_ = false;
 
 public:
 
@@ -42,6 +59,7 @@ public:
         int32_ty_ = Type::getInt32Ty(m->getContext());
         int8_ptr_ty_ = Type::getInt8PtrTy(m->getContext());
         int8_ptr_ptr_ty_ = int8_ptr_ty_->getPointerTo();
+        int64_ty_ = Type::getInt64Ty(m->getContext());
         int32_zero_ = ConstantInt::get(int32_ty_, 0, true);
     }
 
@@ -61,7 +79,8 @@ public:
         // and attach it to the IR builder
         builder_.SetInsertPoint(bb);
         // With this preparation done, tree traversal can begin:
-        tree->accept(*this); 
+        // The last node of the walk is the root of the expression, so v_ holds its value afterwards.
+        traverse(*tree);
 
         // After tree traversal, the computed value is printed via a call to the calc_write() function. 
         // Again, a function prototype (an instance of FunctionType) must be created.
@@ -74,8 +93,233 @@ public:
         builder_.CreateRet(int32_zero_);
     }
 
+    // The batch kernel evaluates the expression once per row:
+    //
+    //     void calc_eval(const int32_t *const *cols, int32_t *out, size_t n) {
+    //         const int32_t *a = cols[0], *b = cols[1], ...;
+    //         for (size_t i = 0; i != n; ++i)
+    //             out[i] = <expression with a[i], b[i], ...>;
+    //     }
+    //
+    // The loop body is a single basic block without calls, and out can't alias a column (noalias),
+    //     so the loop vectorizer can turn it into SIMD code at -O2 and above.
+    void runBatch(AST *tree) {
+        safe_ = true;
+        LLVMContext &ctx = m_->getContext();
+        Type *int32_ptr_ty = int32_ty_->getPointerTo();
+        FunctionType *eval_fty = FunctionType::get(void_ty_, {int32_ptr_ty->getPointerTo(), int32_ptr_ty, int64_ty_}, false);
+        Function *eval_fn = Function::Create(eval_fty, GlobalValue::ExternalLinkage, "calc_eval", m_);
+        eval_fn->setDoesNotThrow();
+        Argument *cols = eval_fn->getArg(0);
+        Argument *out = eval_fn->getArg(1);
+        Argument *n = eval_fn->getArg(2);
+        cols->setName("cols");
+        out->setName("out");
+        n->setName("n");
+        for (Argument *arg : {cols, out}) {
+            arg->addAttr(Attribute::NoAlias);
+            arg->addAttr(Attribute::NoCapture);
+        }
+        cols->addAttr(Attribute::ReadOnly);
+        out->addAttr(Attribute::WriteOnly);
+
+        BasicBlock *entry_bb = BasicBlock::Create(ctx, "entry", eval_fn);
+        BasicBlock *loop_bb = BasicBlock::Create(ctx, "loop", eval_fn);
+        BasicBlock *exit_bb = BasicBlock::Create(ctx, "exit", eval_fn);
+
+        // The column pointers are loaded once, before the loop.
+        builder_.SetInsertPoint(entry_bb);
+        auto *decl = dyn_cast<WithDecl>(tree);
+        SmallVector<Value *, 8> col_ptrs;
+        if (decl) {
+            for (size_t i = 0, e = decl->getVars().size(); i != e; ++i) {
+                Value *slot = builder_.CreateConstInBoundsGEP1_64(int32_ptr_ty, cols, i);
+                col_ptrs.push_back(builder_.CreateLoad(int32_ptr_ty, slot, Twine(decl->getVars()[i]).concat(".col")));
+            }
+        }
+        builder_.CreateCondBr(builder_.CreateICmpEQ(n, ConstantInt::get(int64_ty_, 0)), exit_bb, loop_bb);
+
+        // The batch runtime needs the number of columns, it is exported next to the kernel:
+        //     const int32_t calc_num_vars;
+        new GlobalVariable(*m_, int32_ty_, /*isConstant*/true, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(int32_ty_, col_ptrs.size()), "calc_num_vars");
+
+        // Each iteration loads the variables of the row and computes the expression.
+        builder_.SetInsertPoint(loop_bb);
+        PHINode *row = builder_.CreatePHI(int64_ty_, 2, "row");
+        row->addIncoming(ConstantInt::get(int64_ty_, 0), entry_bb);
+        Expr *e = decl ? decl->getExpr() : cast<Expr>(tree);
+        if (decl) {
+            ArrayRef<uint32_t> symbols = decl->getSymbols();
+            for (size_t i = 0, e = symbols.size(); i != e; ++i) {
+                Value *ptr = builder_.CreateInBoundsGEP(int32_ty_, col_ptrs[i], row);
+                setSymbolValue(symbols[i], builder_.CreateLoad(int32_ty_, ptr, decl->getVars()[i]));
+            }
+        }
+        walkPostOrder(e);
+        builder_.CreateStore(v_, builder_.CreateInBoundsGEP(int32_ty_, out, row));
+
+        Value *next = builder_.CreateNUWAdd(row, ConstantInt::get(int64_ty_, 1), "row.next");
+        row->addIncoming(next, loop_bb);
+        builder_.CreateCondBr(builder_.CreateICmpEQ(next, n), exit_bb, loop_bb);
+
+        builder_.SetInsertPoint(exit_bb);
+        builder_.CreateRetVoid();
+    }
+
+    // The fused kernel evaluates several expressions in one loop:
+    //
+    //     void calc_eval_fused(const int32_t *const *cols, int32_t *const *outs, size_t n) {
+    //         const int32_t *a = cols[0], *b = cols[1], ...;
+    //         int32_t *out0 = outs[0], *out1 = outs[1], ...;
+    //         for (size_t i = 0; i != n; ++i) {
+    //             out0[i] = <first expression with a[i], b[i], ...>;
+    //             out1[i] = <second expression>;
+    //             ...
+    //         }
+    //     }
+    //
+    // The trees come from one ASTContext, so a variable has the same symbol in all of them,
+    //     and a subexpression which several of them contain is the same node.
+    // Each variable becomes one column, loaded once per row, and each node is lowered once (see values_),
+    //     so what the expressions have in common is computed once.
+    // The columns and the outputs are separate arrays, like out and the columns of calc_eval().
+    // There is no noalias for the pointers inside an array, so the accesses carry alias scopes instead:
+    //     the vectorizer needs no run-time checks of the overlap.
+    void runFused(ArrayRef<AST *> trees) {
+        safe_ = true;
+        LLVMContext &ctx = m_->getContext();
+        Type *int32_ptr_ty = int32_ty_->getPointerTo();
+        FunctionType *eval_fty = FunctionType::get(
+            void_ty_, {int32_ptr_ty->getPointerTo(), int32_ptr_ty->getPointerTo(), int64_ty_}, false);
+        Function *eval_fn = Function::Create(eval_fty, GlobalValue::ExternalLinkage, "calc_eval_fused", m_);
+        eval_fn->setDoesNotThrow();
+        Argument *cols = eval_fn->getArg(0);
+        Argument *outs = eval_fn->getArg(1);
+        Argument *n = eval_fn->getArg(2);
+        cols->setName("cols");
+        outs->setName("outs");
+        n->setName("n");
+        for (Argument *arg : {cols, outs}) {
+            arg->addAttr(Attribute::NoAlias);
+            arg->addAttr(Attribute::NoCapture);
+            arg->addAttr(Attribute::ReadOnly);
+        }
+
+        BasicBlock *entry_bb = BasicBlock::Create(ctx, "entry", eval_fn);
+        BasicBlock *loop_bb = BasicBlock::Create(ctx, "loop", eval_fn);
+        BasicBlock *exit_bb = BasicBlock::Create(ctx, "exit", eval_fn);
+
+        // the union of the declared variables, in the order they are first declared
+        SmallVector<uint32_t, 8> col_symbols;
+        SmallVector<StringRef, 8> col_names;
+        for (AST *tree : trees) {
+            if (auto *decl = dyn_cast<WithDecl>(tree)) {
+                for (size_t i = 0, e = decl->getSymbols().size(); i != e; ++i) {
+                    if (!is_contained(col_symbols, decl->getSymbols()[i])) {
+                        col_symbols.push_back(decl->getSymbols()[i]);
+                        col_names.push_back(decl->getVars()[i]);
+                    }
+                }
+            }
+        }
+
+        // one scope for the columns, which are only read, and one for each output
+        MDBuilder mdb(ctx);
+        MDNode *domain = mdb.createAnonymousAliasScopeDomain("calc_eval_fused");
+        MDNode *cols_scope = mdb.createAnonymousAliasScope(domain, "cols");
+        SmallVector<Metadata *, 8> out_scopes;
+        for (size_t k = 0; k != trees.size(); ++k)
+            out_scopes.push_back(mdb.createAnonymousAliasScope(domain, ("out" + Twine(k)).str()));
+        auto setScope = [&](Instruction *inst, Metadata *scope) {
+            SmallVector<Metadata *, 8> others;
+            if (scope != cols_scope)
+                others.push_back(cols_scope);
+            for (Metadata *s : out_scopes) {
+                if (s != scope)
+                    others.push_back(s);
+            }
+            inst->setMetadata(LLVMContext::MD_alias_scope, MDNode::get(ctx, scope));
+            inst->setMetadata(LLVMContext::MD_noalias, MDNode::get(ctx, others));
+        };
+
+        // The pointers are loaded once, before the loop.
+        builder_.SetInsertPoint(entry_bb);
+        SmallVector<Value *, 8> col_ptrs, out_ptrs;
+        for (size_t i = 0; i != col_symbols.size(); ++i) {
+            Value *slot = builder_.CreateConstInBoundsGEP1_64(int32_ptr_ty, cols, i);
+            col_ptrs.push_back(builder_.CreateLoad(int32_ptr_ty, slot, Twine(col_names[i]).concat(".col")));
+        }
+        for (size_t k = 0; k != trees.size(); ++k) {
+            Value *slot = builder_.CreateConstInBoundsGEP1_64(int32_ptr_ty, outs, k);
+            out_ptrs.push_back(builder_.CreateLoad(int32_ptr_ty, slot, "out" + Twine(k)));
+        }
+        builder_.CreateCondBr(builder_.CreateICmpEQ(n, ConstantInt::get(int64_ty_, 0)), exit_bb, loop_bb);
+
+        // The batch runtime needs the numbers of columns and outputs:
+        //     const int32_t calc_num_vars, calc_num_outputs;
+        new GlobalVariable(*m_, int32_ty_, /*isConstant*/true, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(int32_ty_, col_ptrs.size()), "calc_num_vars");
+        new GlobalVariable(*m_, int32_ty_, /*isConstant*/true, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(int32_ty_, out_ptrs.size()), "calc_num_outputs");
+
+        // Each iteration loads the variables of the row once and computes all the expressions.
+        builder_.SetInsertPoint(loop_bb);
+        PHINode *row = builder_.CreatePHI(int64_ty_, 2, "row");
+        row->addIncoming(ConstantInt::get(int64_ty_, 0), entry_bb);
+        for (size_t i = 0; i != col_symbols.size(); ++i) {
+            Value *ptr = builder_.CreateInBoundsGEP(int32_ty_, col_ptrs[i], row);
+            LoadInst *load = builder_.CreateLoad(int32_ty_, ptr, col_names[i]);
+            setScope(load, cols_scope);
+            setSymbolValue(col_symbols[i], load);
+        }
+        for (size_t k = 0; k != trees.size(); ++k) {
+            auto *decl = dyn_cast<WithDecl>(trees[k]);
+            walkPostOrder(decl ? decl->getExpr() : cast<Expr>(trees[k]));
+            StoreInst *store = builder_.CreateStore(v_, builder_.CreateInBoundsGEP(int32_ty_, out_ptrs[k], row));
+            setScope(store, out_scopes[k]);
+        }
+
+        Value *next = builder_.CreateNUWAdd(row, ConstantInt::get(int64_ty_, 1), "row.next");
+        row->addIncoming(next, loop_bb);
+        builder_.CreateCondBr(builder_.CreateICmpEQ(next, n), exit_bb, loop_bb);
+
+        builder_.SetInsertPoint(exit_bb);
+        builder_.CreateRetVoid();
+    }
+
+    // A function of its own for the expression, used when many expressions go into one module:
+    //
+    //     int32_t name(const int32_t *vars) {
+    //         return <expression with vars[0], vars[1], ...>;
+    //     }
+    Function *runFunction(AST *tree, const Twine &name, bool safe) {
+        safe_ = safe;
+        Type *int32_ptr_ty = int32_ty_->getPointerTo();
+        FunctionType *fty = FunctionType::get(int32_ty_, {int32_ptr_ty}, false);
+        Function *fn = Function::Create(fty, GlobalValue::ExternalLinkage, name, m_);
+        fn->setDoesNotThrow();
+        Argument *vars = fn->getArg(0);
+        vars->setName("vars");
+        vars->addAttr(Attribute::NoCapture);
+        vars->addAttr(Attribute::ReadOnly);
+
+        builder_.SetInsertPoint(BasicBlock::Create(m_->getContext(), "entry", fn));
+        auto *decl = dyn_cast<WithDecl>(tree);
+        if (decl) {
+            ArrayRef<uint32_t> symbols = decl->getSymbols();
+            for (size_t i = 0, e = symbols.size(); i != e; ++i) {
+                Value *ptr = builder_.CreateConstInBoundsGEP1_64(int32_ty_, vars, i);
+                setSymbolValue(symbols[i], builder_.CreateLoad(int32_ty_, ptr, decl->getVars()[i]));
+            }
+        }
+        walkPostOrder(decl ? decl->getExpr() : cast<Expr>(tree));
+        builder_.CreateRet(v_);
+        return fn;
+    }
+
     // A WithDecl node holds the names of the declared variables.
-    virtual void visit(WithDecl &node) override {
+    void visit(WithDecl &node) {
         
         // llvm::outs() << "ToIRVisitor::WithDecl\n";
         // First, we must create a function prototype for the calc_read() function:
@@ -83,9 +327,10 @@ public:
         Function *read_fn = Function::Create(read_fty, GlobalValue::ExternalLinkage, "calc_read", m_);
 
         // The method loops through the variable names:
-        for (auto i = node.begin(), e = node.end(); i != e; ++i) {
+        llvm::ArrayRef<uint32_t> symbols = node.getSymbols();
+        for (size_t i = 0, e = symbols.size(); i != e; ++i) {
             // For each variable, a string with a variable name is created:
-            StringRef var = *i;
+            StringRef var = node.getVars()[i];
             Constant *str_text = ConstantDataArray::getString(m_->getContext(), var);
             GlobalVariable *str = new GlobalVariable(*m_, str_text->getType(),
                                                     /*isConstant*/true,
@@ -126,56 +371,120 @@ public:
             // llvm::outs() << "    ptr = " << *ptr << "\n";
 
             
-            // The returned value is stored in the mapNames map for later use:
-            name_map_[var] = call;
+            // The returned value is stored in the symbol_values_ array for later use:
+            setSymbolValue(symbols[i], call);
         }
 
         // Tree traversal continues with the expression:
-        node.getExpr()->accept(*this);
+        walkPostOrder(node.getExpr());
     }
 
     // A Factor node is either a variable name or a number
-    virtual void visit(Factor &node) override {
+    void visit(Factor &node) {
+        if (reuse(node))
+            return;
         if (node.getKind() == Factor::Ident) {
-            // For a variable name, the value is looked up in the mapNames map. 
-            v_ = name_map_[node.getVal()];
+            // For a variable name, the value is found in the symbol_values_ array.
+            // Sema has checked that the variable is declared, so the ID is in range.
+            v_ = symbol_values_[node.getSymbol()];
         }
         else {
-            // For a number, the value is converted into an integer and turned into a constant value:
-            int int_val;
-            node.getVal().getAsInteger(10, int_val);
-            v_ = ConstantInt::get(int32_ty_, int_val, true);
+            // For a number, the value decoded by the lexer is turned into a constant value:
+            v_ = ConstantInt::get(int32_ty_, node.getNumber(), true);
         }
+        values_[&node] = v_;
     }
 
     // for a BinaryOp node, the right calculation operation must be used
-    virtual void visit(BinaryOp &node) override {
-        node.getLeft()->accept(*this);
-        Value *left = v_;
-        node.getRight()->accept(*this);
-        Value *right = v_;
+    void visit(BinaryOp &node) {
+        if (reuse(node))
+            return;
+        Value *left = values_.lookup(node.getLeft());
+        Value *right = values_.lookup(node.getRight());
         switch (node.getOperator()) {
             case BinaryOp::Plus:
-                v_ = builder_.CreateNSWAdd(left, right); break;
+                v_ = safe_ ? builder_.CreateAdd(left, right) : builder_.CreateNSWAdd(left, right); break;
             case BinaryOp::Minus:
-                v_ = builder_.CreateNSWSub(left, right); break;
+                v_ = safe_ ? builder_.CreateSub(left, right) : builder_.CreateNSWSub(left, right); break;
             case BinaryOp::Mul:
-                v_ = builder_.CreateNSWMul(left, right); break;
+                v_ = safe_ ? builder_.CreateMul(left, right) : builder_.CreateNSWMul(left, right); break;
             case BinaryOp::Div:
-                v_ = builder_.CreateSDiv(left, right); break;
+                v_ = safe_ ? createSafeDiv(left, right) : builder_.CreateSDiv(left, right); break;
+        }
+        values_[&node] = v_;
+    }
+
+    // A node which was lowered by an earlier walk over the same function keeps its value,
+    //     e.g. a subexpression which the expressions of a fused kernel share.
+    bool reuse(Expr &node) {
+        if (Value *v = values_.lookup(&node)) {
+            v_ = v;
+            return true;
         }
+        return false;
+    }
+
+    void setSymbolValue(uint32_t symbol, Value *v) {
+        if (symbol >= symbol_values_.size())
+            symbol_values_.resize(symbol + 1);
+        symbol_values_[symbol] = v;
+    }
+
+    // A division which gives a value for every input, so it can be evaluated for all lanes of a vector:
+    //     x/0 is 0, and x/-1 is computed as 0-x, which wraps for INT_MIN like the other operators.
+    // The sdiv itself only sees divisors other than 0 and -1, so it never traps,
+    //     and no branch is needed to protect it.
+    Value *createSafeDiv(Value *left, Value *right) {
+        Constant *one = ConstantInt::get(int32_ty_, 1, true);
+        Constant *minus_one = ConstantInt::get(int32_ty_, -1, true);
+        Value *is_zero = builder_.CreateICmpEQ(right, int32_zero_);
+        Value *is_minus_one = builder_.CreateICmpEQ(right, minus_one);
+        Value *divisor = builder_.CreateSelect(builder_.CreateOr(is_zero, is_minus_one), one, right);
+        Value *quot = builder_.CreateSDiv(left, divisor);
+        Value *res = builder_.CreateSelect(is_minus_one, builder_.CreateNeg(left), quot);
+        return builder_.CreateSelect(is_zero, int32_zero_, res);
     }
 }; // class
 
 }; // namespace
 
 
-// The compile() method creates the global context and the module, 
-// runs the tree traversal, and dumps the generated IR to the console:
-void CodeGen::compile(AST *tree) {
-    LLVMContext ctx;
-    Module *m = new Module("calc.expr", ctx);
-    ToIRVisitor to_ir(m);
+// The compile() method creates the module inside the given context
+// and runs the tree traversal, the module is then returned to the driver:
+std::unique_ptr<Module> CodeGen::compile(AST *tree, LLVMContext &ctx) {
+    auto m = std::make_unique<Module>("calc.expr", ctx);
+    ToIRVisitor to_ir(m.get());
     to_ir.run(tree);
-    m->print(outs(), nullptr);
-}
\ No newline at end of file
+    applyTarget(*m);
+    return m;
+}
+
+std::unique_ptr<Module> CodeGen::compileFused(ArrayRef<AST *> trees, LLVMContext &ctx) {
+    auto m = std::make_unique<Module>("calc.expr", ctx);
+    ToIRVisitor to_ir(m.get());
+    to_ir.runFused(trees);
+    applyTarget(*m);
+    return m;
+}
+
+std::unique_ptr<Module> CodeGen::compileBatch(AST *tree, LLVMContext &ctx) {
+    auto m = std::make_unique<Module>("calc.expr", ctx);
+    ToIRVisitor to_ir(m.get());
+    to_ir.runBatch(tree);
+    applyTarget(*m);
+    return m;
+}
+
+Function *CodeGen::compileFunction(AST *tree, const Twine &name, Module &m, bool safe) {
+    ToIRVisitor to_ir(&m);
+    Function *fn = to_ir.runFunction(tree, name, safe);
+    target_.apply(*fn);
+    return fn;
+}
+
+void CodeGen::applyTarget(Module &m) const {
+    for (Function &fn : m) {
+        if (!fn.isDeclaration())
+            target_.apply(fn);
+    }
+}
@@ -1,10 +1,47 @@
 #pragma once
 
 #include "ast.h"
+#include "target_cpu.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include <memory>
 
 class CodeGen {
+    TargetCPU target_;
+
+    // tunes the functions defined in the module for target_
+    void applyTarget(llvm::Module &m) const;
 
 public:
-    void compile(AST *tree);
+    // the functions are tuned for the CPU (see TargetCPU), by default for any CPU
+    CodeGen(const TargetCPU &target = TargetCPU()) : target_(target) {}
+
+    // Builds the IR module for the tree inside the given context.
+    // The caller decides what happens next: print the IR, hand it to the JIT, ...
+    std::unique_ptr<llvm::Module> compile(AST *tree, llvm::LLVMContext &ctx);
+
+    // Builds a module with a batch kernel instead of main():
+    //     void calc_eval(const int32_t *const *cols, int32_t *out, size_t n)
+    // The i-th declared variable is read from the column cols[i],
+    //     and out[r] is the value of the expression for the row r, 0 <= r < n.
+    // Every input gives a defined result in a kernel: overflow wraps around,
+    //     and division doesn't trap: x/0 is 0 and INT_MIN/-1 is INT_MIN.
+    std::unique_ptr<llvm::Module> compileBatch(AST *tree, llvm::LLVMContext &ctx);
+
+    // Builds a module with one kernel for several expressions of the same ASTContext:
+    //     void calc_eval_fused(const int32_t *const *cols, int32_t *const *outs, size_t n)
+    // The columns are the union of the declared variables, in the order they are first declared,
+    //     and outs[k][r] is the value of the k-th expression for the row r.
+    // Each column is read once per row for all the expressions, and a subexpression
+    //     which several expressions share is computed once. The values are those of compileBatch().
+    std::unique_ptr<llvm::Module> compileFused(llvm::ArrayRef<AST *> trees, llvm::LLVMContext &ctx);
+
+    // Adds the expression to an existing module as a function of its own:
+    //     int32_t name(const int32_t *vars)
+    // The i-th declared variable is vars[i]. Many expressions can share one module this way.
+    // With safe, every input gives a defined result, like in compileBatch().
+    llvm::Function *compileFunction(AST *tree, const llvm::Twine &name, llvm::Module &m,
+                                    bool safe = false);
 
-};
\ No newline at end of file
+};
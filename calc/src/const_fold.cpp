@@ -0,0 +1,211 @@
+#include "const_fold.h"
+#include <cstdint>
+
+// The folding is done by a rewriting visitor: after a node is visited,
+// res_ describes the simplified replacement of the node.
+// The facts needed by the parent (is it a number, may it trap, is it x+c) are recorded there as well,
+// so they don't have to be recomputed by looking into the subtree again.
+// The tree is walked in post-order, the results of the operands are kept in memo_ for the parent.
+// Nodes are shared in the DAG built by ASTContext, so each of them is folded only once.
+
+namespace {
+
+class Folder : public ASTVisitorBase<Folder> {
+    ASTContext &ctx_;
+
+    struct Folded {
+        Expr *expr = nullptr;
+        bool is_const = false;  // expr is a number with the value val
+        int64_t val = 0;
+        bool may_trap = false;  // evaluating expr may trap, because it contains a division
+        // expr is "base op c" with op either Plus or Mul, and the constant c;
+        // this is used to combine constants of chains like (x+1)+2
+        bool has_const_operand = false;
+        BinaryOp::Operator op = BinaryOp::Plus;
+        Expr *base = nullptr;
+        int64_t const_operand = 0;
+    };
+
+    Folded res_;
+    AST *root_ = nullptr;
+    llvm::DenseMap<Expr *, Folded> memo_;
+
+    static bool fitsInt32(int64_t v) {
+        return v >= INT32_MIN && v <= INT32_MAX;
+    }
+
+    // the generated code wraps around on overflow, and so does folding
+    static int64_t wrap(int64_t v) {
+        return static_cast<int32_t>(static_cast<uint32_t>(v));
+    }
+
+    Folded makeConst(int64_t v) {
+        Folded f;
+        f.val = wrap(v);
+        f.is_const = true;
+        f.expr = ctx_.getNumber(int32_t(f.val));
+        return f;
+    }
+
+    // creates "l op r"; if neither side changed, this is the original node
+    Folded makeBinary(BinaryOp::Operator op, const Folded &l, const Folded &r) {
+        Folded f;
+        f.expr = ctx_.getBinaryOp(op, l.expr, r.expr);
+        f.may_trap = l.may_trap || r.may_trap ||
+                     (op == BinaryOp::Div && !(r.is_const && r.val != 0 && r.val != -1));
+        if ((op == BinaryOp::Plus || op == BinaryOp::Mul) && r.is_const) {
+            f.has_const_operand = true;
+            f.op = op;
+            f.base = l.expr;
+            f.const_operand = r.val;
+        }
+        return f;
+    }
+
+    // both sides are hash-consed, so equal subtrees are the same node
+    static bool isSame(const Folded &l, const Folded &r) {
+        return l.expr == r.expr;
+    }
+
+    void foldBinaryOp(BinaryOp &node);
+
+public:
+    Folder(ASTContext &ctx) : ctx_(ctx) {}
+
+    AST *getRoot() { return root_; }
+    Expr *getExpr() { return res_.expr; }
+
+    void visit(Factor &node) {
+        res_ = Folded();
+        res_.expr = &node;
+        if (node.getKind() == Factor::Number) {
+            res_.is_const = true;
+            res_.val = node.getNumber();
+        }
+        memo_[&node] = res_;
+    }
+
+    void visit(BinaryOp &node) {
+        foldBinaryOp(node);
+        memo_[&node] = res_;
+    }
+
+    void visit(WithDecl &node) {
+        walkPostOrder(node.getExpr());
+        if (res_.expr == node.getExpr()) {
+            root_ = &node;
+            return;
+        }
+        root_ = ctx_.createWithDecl(node.getVars(), res_.expr);
+    }
+}; // class Folder
+
+void Folder::foldBinaryOp(BinaryOp &node) {
+    Folded l = memo_.lookup(node.getLeft());
+    Folded r = memo_.lookup(node.getRight());
+    BinaryOp::Operator op = node.getOperator();
+
+    // both sides are numbers
+    if (l.is_const && r.is_const) {
+        switch (op) {
+            case BinaryOp::Plus:
+                res_ = makeConst(l.val + r.val); return;
+            case BinaryOp::Minus:
+                res_ = makeConst(l.val - r.val); return;
+            case BinaryOp::Mul:
+                res_ = makeConst(l.val * r.val); return;
+            case BinaryOp::Div:
+                // these divisions trap at runtime, so they are kept
+                if (r.val != 0 && !(l.val == INT32_MIN && r.val == -1)) {
+                    res_ = makeConst(l.val / r.val);
+                    return;
+                }
+                break;
+        }
+        res_ = makeBinary(op, l, r);
+        return;
+    }
+
+    // the number goes to the right side of + and *
+    if ((op == BinaryOp::Plus || op == BinaryOp::Mul) && l.is_const)
+        std::swap(l, r);
+
+    switch (op) {
+        case BinaryOp::Plus:
+            if (r.is_const && r.val == 0) { // x+0
+                res_ = l;
+                return;
+            }
+            break;
+        case BinaryOp::Minus:
+            if (r.is_const && r.val == 0) { // x-0
+                res_ = l;
+                return;
+            }
+            if (isSame(l, r) && !l.may_trap) { // x-x
+                res_ = makeConst(0);
+                return;
+            }
+            // x-c is turned into x+(-c), so that it can be combined with other constants
+            if (r.is_const && r.val != INT32_MIN) {
+                op = BinaryOp::Plus;
+                r = makeConst(-r.val);
+            }
+            break;
+        case BinaryOp::Mul:
+            if (r.is_const && r.val == 1) { // x*1
+                res_ = l;
+                return;
+            }
+            if (r.is_const && r.val == 0 && !l.may_trap) { // x*0
+                res_ = makeConst(0);
+                return;
+            }
+            break;
+        case BinaryOp::Div:
+            if (r.is_const && r.val == 1) { // x/1
+                res_ = l;
+                return;
+            }
+            break;
+    }
+
+    // (x+c1)+c2 becomes x+(c1+c2) and (x*c1)*c2 becomes x*(c1*c2).
+    // This is only done if the combined constant doesn't overflow:
+    //     then x op (c1 op c2) has the same mathematical value as the original,
+    //     so it can't overflow if the original didn't.
+    if (r.is_const && l.has_const_operand && l.op == op) {
+        int64_t c = op == BinaryOp::Plus ? l.const_operand + r.val
+                                         : l.const_operand * r.val;
+        if (fitsInt32(c)) {
+            Folded base;
+            base.expr = l.base;
+            base.may_trap = l.may_trap;
+            // the combined constant may itself be an identity
+            if ((op == BinaryOp::Plus && c == 0) || (op == BinaryOp::Mul && c == 1)) {
+                res_ = base;
+                return;
+            }
+            res_ = makeBinary(op, base, makeConst(c));
+            return;
+        }
+    }
+
+    res_ = makeBinary(op, l, r);
+}
+
+} // namespace
+
+
+AST *ConstFold::fold(AST *tree) {
+    if (!tree)
+        return nullptr;
+
+    Folder folder(ctx_);
+    // after the walk, res_ describes the root of the expression
+    folder.traverse(*tree);
+    // a tree without a with declaration is a bare expression
+    if (folder.getRoot())
+        return folder.getRoot();
+    return folder.getExpr();
+}
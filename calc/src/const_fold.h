@@ -0,0 +1,20 @@
+#pragma once
+
+#include "ast.h"
+
+// ConstFold simplifies the tree between Sema::semantic() and CodeGen::compile().
+// It folds constant subtrees, removes the identities x*1, x+0, x*0 and x-x,
+// and combines the constants of chains like (x+1)+2 or (x*2)*3,
+// so that less IR has to be built for generated input.
+//
+// Division keeps its trap semantics: a division by 0 (or INT_MIN / -1) is never folded,
+// and a subtree that contains such a division is never dropped by x*0 or x-x.
+class ConstFold {
+    ASTContext &ctx_; // creates the simplified nodes
+
+public:
+    ConstFold(ASTContext &ctx) : ctx_(ctx) {}
+
+    // Returns the simplified tree. Unchanged subtrees are shared with the input tree.
+    AST *fold(AST *tree);
+};
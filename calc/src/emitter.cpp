@@ -0,0 +1,86 @@
+#include "emitter.h"
+#include "phase_timer.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+
+using namespace llvm;
+
+std::unique_ptr<ObjectEmitter> ObjectEmitter::create(bool pic, unsigned opt_level, const TargetCPU &cpu,
+                                                     raw_ostream &diags) {
+    // Only code for the host is generated, so only the native target is needed.
+    // The registration of the target is not thread safe, and FileCompiler creates
+    //     an emitter on each thread of its pool.
+    static std::once_flag init_flag;
+    std::call_once(init_flag, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        // the resolvers of -multiversion ask the CPU with inline assembly (see MultiVersion)
+        InitializeNativeTargetAsmParser();
+    });
+
+    std::string triple = sys::getDefaultTargetTriple();
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        diags << "calc: " << error << "\n";
+        return nullptr;
+    }
+
+    TargetOptions options;
+    Optional<Reloc::Model> reloc_model;
+    if (pic)
+        reloc_model = Reloc::PIC_;
+    CodeGenOpt::Level cg_level = opt_level == 0 ? CodeGenOpt::None :
+                                 opt_level == 1 ? CodeGenOpt::Less :
+                                 opt_level == 2 ? CodeGenOpt::Default :
+                                                  CodeGenOpt::Aggressive;
+    std::unique_ptr<TargetMachine> tm(target->createTargetMachine(
+        triple, cpu.cpu, cpu.features, options, reloc_model, None, cg_level));
+    if (!tm) {
+        diags << "calc: could not create a target machine for " << triple << "\n";
+        return nullptr;
+    }
+    return std::unique_ptr<ObjectEmitter>(new ObjectEmitter(std::move(tm), diags));
+}
+
+void ObjectEmitter::prepare(Module &m) {
+    m.setTargetTriple(tm_->getTargetTriple().getTriple());
+    m.setDataLayout(tm_->createDataLayout());
+}
+
+bool ObjectEmitter::emit(Module &m, StringRef file_name) {
+    prepare(m);
+
+    std::error_code ec;
+    raw_fd_ostream out(file_name, ec, sys::fs::OF_None);
+    if (ec) {
+        diags_ << "calc: could not open " << file_name << ": " << ec.message() << "\n";
+        return true;
+    }
+    return emit(m, out);
+}
+
+bool ObjectEmitter::emit(Module &m, SmallVectorImpl<char> &obj) {
+    prepare(m);
+    raw_svector_ostream out(obj);
+    return emit(m, out);
+}
+
+bool ObjectEmitter::emit(Module &m, raw_pwrite_stream &out) {
+    PhaseTimer timer("codegen", "Backend code generation");
+    // The backend still runs on the legacy pass manager.
+    // addPassesToEmitFile() returns true if the target can't emit this file type.
+    legacy::PassManager pm;
+    if (tm_->addPassesToEmitFile(pm, out, nullptr, CGFT_ObjectFile)) {
+        diags_ << "calc: the target can't emit an object file\n";
+        return true;
+    }
+    pm.run(m);
+    out.flush();
+    return false;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "target_cpu.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+
+// Emits native object code straight from the in-memory module,
+// so there is no need to print the IR and run llc on it (see run.sh).
+class ObjectEmitter {
+    std::unique_ptr<llvm::TargetMachine> tm_;
+    llvm::raw_ostream &diags_;
+
+    bool emit(llvm::Module &m, llvm::raw_pwrite_stream &out);
+
+    ObjectEmitter(std::unique_ptr<llvm::TargetMachine> tm, llvm::raw_ostream &diags)
+        : tm_(std::move(tm)), diags_(diags) {}
+
+public:
+    // Sets up a TargetMachine for the host, opt_level (0-3) selects the backend optimizations.
+    // With pic, the object is position independent and can be linked into a shared library.
+    // The code is generated for cpu, functions with a CPU of their own
+    //     (see TargetCPU::apply()) keep theirs.
+    // Returns nullptr and prints the reason to diags if the target is not available,
+    //     the errors of emit() go there too.
+    // Emitters may be created on several threads, each one is used by one thread only.
+    static std::unique_ptr<ObjectEmitter> create(bool pic, unsigned opt_level,
+                                                 const TargetCPU &cpu = TargetCPU(),
+                                                 llvm::raw_ostream &diags = llvm::errs());
+
+    llvm::TargetMachine &getTargetMachine() { return *tm_; }
+
+    // stamps the target triple and data layout of the TargetMachine on the module
+    void prepare(llvm::Module &m);
+
+    // writes the object file, returns true if an error occurred
+    bool emit(llvm::Module &m, llvm::StringRef file_name);
+
+    // the same, but the object file is kept in memory, e.g. to put it into a cache
+    bool emit(llvm::Module &m, llvm::SmallVectorImpl<char> &obj);
+};
@@ -0,0 +1,279 @@
+#include "expr_cache.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+// bump this when the generated code changes for the same tree
+static const char CacheFormat[] = "calc-cache-2";
+// the prefix of the module identifier which carries the key
+static const char ModuleKeyPrefix[] = "calc.expr-";
+// a temporary file older than this was left behind by a writer which crashed
+static const std::chrono::hours StaleTempAge(1);
+
+namespace {
+
+// Writes the tree in a canonical text form which is then hashed.
+// The nodes are numbered in post-order, and an operator refers to its operands by number,
+//     so a shared subexpression is written once, like it is compiled once.
+class KeyWriter : public ASTVisitorBase<KeyWriter> {
+    raw_ostream &os_;
+    DenseMap<Expr *, unsigned> ids_;
+
+    void number(Expr &node) {
+        unsigned id = ids_.size();
+        ids_[&node] = id;
+    }
+
+public:
+    KeyWriter(raw_ostream &os) : os_(os) {}
+
+    void visit(Factor &node) {
+        if (node.getKind() == Factor::Ident)
+            os_ << "i" << node.getVal() << ";";
+        else
+            os_ << "n" << node.getNumber() << ";";
+        number(node);
+    }
+
+    void visit(BinaryOp &node) {
+        os_ << "b" << unsigned(node.getOperator()) << ","
+            << ids_.lookup(node.getLeft()) << "," << ids_.lookup(node.getRight()) << ";";
+        number(node);
+    }
+
+    // the order of the variables matters, it is the order of the inputs
+    void visit(WithDecl &node) {
+        os_ << "w";
+        for (StringRef var : node.getVars())
+            os_ << var << ",";
+        os_ << ";";
+        walkPostOrder(node.getExpr());
+    }
+};
+
+} // namespace
+
+std::string ExprCache::computeKey(AST *tree, StringRef config) {
+    std::string text;
+    raw_string_ostream os(text);
+    os << CacheFormat << "\n" << LLVM_VERSION_STRING << "\n" << config << "\n";
+    KeyWriter writer(os);
+    writer.traverse(*tree);
+    os.flush();
+
+    SHA1 hasher;
+    hasher.update(text);
+    return toHex(hasher.result(), /*LowerCase*/true);
+}
+
+std::string ExprCache::describeTarget(const TargetMachine &tm) {
+    return (tm.getTargetTriple().str() + " " + tm.getTargetCPU() + " " + tm.getTargetFeatureString()).str();
+}
+
+std::string ExprCache::getPath(StringRef key) const {
+    SmallString<128> path(dir_);
+    sys::path::append(path, key + ".o");
+    return path.str().str();
+}
+
+std::unique_ptr<MemoryBuffer> ExprCache::lookup(StringRef key) {
+    return find(key, /*count*/true);
+}
+
+std::unique_ptr<MemoryBuffer> ExprCache::find(StringRef key, bool count) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            // the entry becomes the most recently used one
+            lru_.splice(lru_.begin(), lru_, it->second);
+            stats_.memory_hits += count;
+            return MemoryBuffer::getMemBufferCopy(it->second->second->getBuffer(), key);
+        }
+    }
+
+    if (!dir_.empty()) {
+        std::string path = getPath(key);
+        auto buf = MemoryBuffer::getFile(path, /*IsText*/false, /*RequiresNullTerminator*/false);
+        if (buf) {
+            // the time of the last use decides which files are evicted first
+            int fd;
+            if (!sys::fs::openFileForRead(path, fd)) {
+                sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+                sys::Process::SafelyCloseFileDescriptor(fd);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            insertMemory(key, (*buf)->getBuffer());
+            stats_.disk_hits += count;
+            return std::move(*buf);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.misses += count;
+    return nullptr;
+}
+
+void ExprCache::store(StringRef key, StringRef obj) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.stores;
+        insertMemory(key, obj);
+    }
+    storeDisk(key, obj);
+}
+
+void ExprCache::insertMemory(StringRef key, StringRef obj) {
+    if (obj.size() > max_memory_bytes_ || entries_.count(key))
+        return;
+    lru_.emplace_front(key.str(), MemoryBuffer::getMemBufferCopy(obj, key));
+    entries_[key] = lru_.begin();
+    memory_bytes_ += obj.size();
+    while (memory_bytes_ > max_memory_bytes_) {
+        memory_bytes_ -= lru_.back().second->getBufferSize();
+        entries_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+}
+
+void ExprCache::storeDisk(StringRef key, StringRef obj) {
+    if (dir_.empty())
+        return;
+    // The cache is best effort: if the object can't be written, it's just not cached.
+    if (sys::fs::create_directories(dir_))
+        return;
+
+    // The object is written to a file of its own first, and then renamed into place.
+    // The rename is atomic, so a concurrent reader never sees a partly written object,
+    //     and if two processes store the same key, one of the (identical) files wins.
+    SmallString<128> tmp_model(dir_);
+    sys::path::append(tmp_model, key + "-%%%%%%.tmp");
+    SmallString<128> tmp_path;
+    int fd;
+    if (sys::fs::createUniqueFile(tmp_model, fd, tmp_path))
+        return;
+    {
+        raw_fd_ostream os(fd, /*shouldClose*/true);
+        os << obj;
+        os.close();
+        if (os.has_error()) {
+            os.clear_error();
+            sys::fs::remove(tmp_path);
+            return;
+        }
+    }
+    if (sys::fs::rename(tmp_path, getPath(key))) {
+        sys::fs::remove(tmp_path);
+        return;
+    }
+
+    // a store of a key which is already on disk is counted twice, the next scan corrects it
+    bool scan;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        disk_bytes_ += obj.size();
+        scan = !disk_scanned_ || disk_bytes_ > max_disk_bytes_;
+    }
+    if (scan)
+        evictDisk();
+}
+
+// Scans the directory and deletes the least recently used objects until it is within its limit.
+// A thread which finds another one scanning leaves it to that one.
+void ExprCache::evictDisk() {
+    std::unique_lock<std::mutex> scanning(scan_mutex_, std::try_to_lock);
+    if (!scanning.owns_lock())
+        return;
+
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        sys::TimePoint<> last_use;
+    };
+    std::vector<Entry> files;
+    uint64_t total = 0, evictions = 0;
+    sys::TimePoint<> stale = std::chrono::system_clock::now() - StaleTempAge;
+    std::error_code ec;
+    for (sys::fs::directory_iterator i(dir_, ec), e; i != e && !ec; i.increment(ec)) {
+        StringRef ext = sys::path::extension(i->path());
+        if (ext != ".o" && ext != ".tmp")
+            continue;
+        sys::fs::file_status status;
+        if (sys::fs::status(i->path(), status))
+            continue;
+        // a temporary file which is being written counts, an old one is deleted
+        if (ext == ".tmp") {
+            if (status.getLastModificationTime() < stale && !sys::fs::remove(i->path()))
+                ++evictions;
+            else
+                total += status.getSize();
+            continue;
+        }
+        files.push_back({i->path(), status.getSize(), status.getLastModificationTime()});
+        total += status.getSize();
+    }
+
+    // below the limit by a tenth, so a full cache isn't scanned again by the next store
+    if (total > max_disk_bytes_) {
+        uint64_t target = max_disk_bytes_ - max_disk_bytes_ / 10;
+        std::sort(files.begin(), files.end(), [](const Entry &a, const Entry &b) {
+            return a.last_use < b.last_use;
+        });
+        for (const Entry &f : files) {
+            if (total <= target)
+                break;
+            // another process may have deleted it already
+            if (!sys::fs::remove(f.path, /*IgnoreNonExisting*/false))
+                ++evictions;
+            total -= f.size;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    disk_scanned_ = true;
+    disk_bytes_ = total;
+    stats_.evictions += evictions;
+}
+
+void ExprCache::setModuleKey(Module &m, StringRef key) {
+    m.setModuleIdentifier((ModuleKeyPrefix + key).str());
+}
+
+void ExprCache::notifyObjectCompiled(const Module *m, MemoryBufferRef obj) {
+    StringRef id = m->getModuleIdentifier();
+    if (id.consume_front(ModuleKeyPrefix))
+        store(id, obj.getBuffer());
+}
+
+// The driver looks the key up before it builds the IR,
+//     so when the JIT asks again for the same module, it is not counted as a second miss.
+std::unique_ptr<MemoryBuffer> ExprCache::getObject(const Module *m) {
+    StringRef id = m->getModuleIdentifier();
+    if (!id.consume_front(ModuleKeyPrefix))
+        return nullptr;
+    return find(id, /*count*/false);
+}
+
+ExprCache::Stats ExprCache::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void ExprCache::printStats(raw_ostream &os) const {
+    Stats s = getStats();
+    os << "calc: cache: " << s.memory_hits + s.disk_hits << " hits ("
+       << s.memory_hits << " in memory, " << s.disk_hits << " on disk), "
+       << s.misses << " misses, " << s.stores << " stores, "
+       << s.evictions << " evictions\n";
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// A cache of compiled expressions, so the same formula isn't compiled again and again.
+//
+// The key is a hash of the folded AST together with everything else that changes the object code:
+//     the kind of output, the optimization level and pipeline, and the target (see computeKey()).
+// Because the tree is hash-consed and folded first, "a+1+1" and "(a + 2)" have the same key.
+//
+// There are two tiers:
+//     - in memory, the most recently used objects up to a size limit (LRU),
+//       this helps a process which compiles many expressions;
+//     - on disk, one file <key>.o per object in a directory shared by all processes.
+// A new file is written under a temporary name and renamed into place,
+//     so other processes see either the whole object or none.
+// When the directory grows beyond its limit, the least recently used files are deleted;
+//     a file deleted by another process in the meantime is just a miss.
+//     The size of the directory is counted by a scan on the first store, then each store adds
+//     its object, and only when the count goes over the limit the directory is scanned again
+//     and trimmed to 90% of the limit.
+//     The scan also deletes the temporary files of writers which crashed.
+// The files are read and written without holding the lock of the memory tier.
+//
+// The cache is also an llvm::ObjectCache, so the JIT can store the objects it compiles.
+// The key of a module is carried in its module identifier (see setModuleKey()).
+class ExprCache : public llvm::ObjectCache {
+public:
+    struct Stats {
+        uint64_t memory_hits = 0;
+        uint64_t disk_hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0; // files deleted from the directory
+    };
+
+private:
+    std::string dir_;
+    uint64_t max_disk_bytes_;
+    uint64_t max_memory_bytes_;
+
+    // the memory tier, the most recently used entry is at the front
+    using LRUList = std::list<std::pair<std::string, std::unique_ptr<llvm::MemoryBuffer>>>;
+    LRUList lru_;
+    llvm::StringMap<LRUList::iterator> entries_;
+    uint64_t memory_bytes_ = 0;
+
+    // the bytes in the directory as far as this process knows, see evictDisk()
+    uint64_t disk_bytes_ = 0;
+    bool disk_scanned_ = false;
+
+    Stats stats_;
+    mutable std::mutex mutex_; // the cache may be shared by several threads
+    std::mutex scan_mutex_;    // one thread scans the directory at a time
+
+    std::string getPath(llvm::StringRef key) const;
+    std::unique_ptr<llvm::MemoryBuffer> find(llvm::StringRef key, bool count);
+    // with mutex_ held
+    void insertMemory(llvm::StringRef key, llvm::StringRef obj);
+    // without mutex_ held
+    void storeDisk(llvm::StringRef key, llvm::StringRef obj);
+    void evictDisk();
+
+public:
+    // dir may be empty, then only the memory tier is used
+    ExprCache(llvm::StringRef dir, uint64_t max_disk_bytes, uint64_t max_memory_bytes = 64 << 20)
+        : dir_(dir.str()), max_disk_bytes_(max_disk_bytes), max_memory_bytes_(max_memory_bytes) {}
+
+    // Computes the key of the (folded) tree.
+    // config describes how the tree is compiled, see describeTarget() for the target part.
+    static std::string computeKey(AST *tree, llvm::StringRef config);
+    // the triple, CPU and features of the target machine
+    static std::string describeTarget(const llvm::TargetMachine &tm);
+
+    // returns a copy of the cached object, or nullptr
+    std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef key);
+    void store(llvm::StringRef key, llvm::StringRef obj);
+
+    // the JIT finds the key of a module in its identifier
+    static void setModuleKey(llvm::Module &m, llvm::StringRef key);
+
+    // llvm::ObjectCache
+    void notifyObjectCompiled(const llvm::Module *m, llvm::MemoryBufferRef obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *m) override;
+
+    Stats getStats() const;
+    void printStats(llvm::raw_ostream &os) const;
+};
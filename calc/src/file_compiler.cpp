@@ -0,0 +1,272 @@
+#include "file_compiler.h"
+#include "code_gen.h"
+#include "const_fold.h"
+#include "emitter.h"
+#include "mem_stats.h"
+#include "multiversion.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "phase_timer.h"
+#include "sema.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <deque>
+#include <future>
+#include <memory>
+
+using namespace llvm;
+
+namespace {
+
+// Cuts the text into expressions and hands them out a chunk at a time.
+// The statements are references into the text, so collecting them copies nothing.
+class Splitter {
+    StringRef rest_;
+    size_t chunk_size_;
+    bool named_;
+    size_t index_ = 0;
+    size_t line_ = 1;
+
+public:
+    Splitter(StringRef text, size_t chunk_size, bool named)
+        : rest_(text), chunk_size_(chunk_size), named_(named) {}
+
+    // splits "name = expr" into the name and the expression,
+    //     the name is a C identifier, so it can be used in the header of a bundle
+    static StringRef splitName(StringRef &text) {
+        StringRef rest = text.ltrim();
+        size_t len = 0;
+        while (len < rest.size() && (isAlpha(rest[len]) || rest[len] == '_' || (len && isDigit(rest[len]))))
+            ++len;
+        StringRef name = rest.take_front(len);
+        rest = rest.drop_front(len).ltrim();
+        // "with" starts an expression, it is not a name
+        if (!len || name == "with" || !rest.startswith("="))
+            return StringRef();
+        text = rest.drop_front(1);
+        return name;
+    }
+
+    // fills the next chunk, returns false if there are no more expressions
+    bool next(std::vector<FileCompiler::Statement> &chunk) {
+        chunk.clear();
+        while (!rest_.empty() && chunk.size() < chunk_size_) {
+            size_t end = rest_.find_first_of("\n;");
+            StringRef text = rest_.substr(0, end);
+            size_t line = line_;
+            if (end != StringRef::npos) {
+                line_ += rest_[end] == '\n';
+                rest_ = rest_.drop_front(end + 1);
+            } else {
+                rest_ = StringRef();
+            }
+            // empty lines and trailing separators are skipped
+            if (text.trim().empty())
+                continue;
+            StringRef name = named_ ? splitName(text) : StringRef();
+            chunk.push_back({text, index_++, line, name});
+        }
+        return !chunk.empty();
+    }
+};
+
+} // namespace
+
+bool FileCompiler::run(StringRef file_name) {
+    // large files are memory-mapped, the pages are only read when the expressions get lexed
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf_or_err =
+        MemoryBuffer::getFile(file_name, /*IsText*/false, /*RequiresNullTerminator*/false);
+    if (!buf_or_err) {
+        errs() << "calc: can't read " << file_name << ": " << buf_or_err.getError().message() << "\n";
+        return true;
+    }
+    return compile((*buf_or_err)->getBuffer(), file_name);
+}
+
+bool FileCompiler::compile(StringRef text, StringRef file_name) {
+    file_name_ = file_name.str();
+    // a fused kernel is one chunk, there is nothing to do in parallel
+    if (opts_.threads == 1 || opts_.fuse)
+        return compileSerial(text);
+    return compileParallel(text);
+}
+
+bool FileCompiler::writeResult(ChunkResult &res) {
+    errs() << res.diags;
+    outs() << res.ir;
+    ++num_chunks_;
+    std::move(res.formulas.begin(), res.formulas.end(), std::back_inserter(formulas_));
+    return res.has_error;
+}
+
+bool FileCompiler::compileSerial(StringRef text) {
+    Splitter splitter(text, opts_.fuse ? SIZE_MAX : opts_.chunk_size, opts_.bundle);
+    std::vector<Statement> stmts;
+    bool has_error = false;
+    size_t chunk = 0;
+    // a file without any expression still gives an (empty) module
+    splitter.next(stmts);
+    do {
+        ChunkResult res;
+        compileChunk(stmts, chunk++, res);
+        has_error |= writeResult(res);
+    } while (splitter.next(stmts));
+    return has_error;
+}
+
+bool FileCompiler::compileParallel(StringRef text) {
+    ThreadPool pool(hardware_concurrency(opts_.threads));
+    unsigned threads = pool.getThreadCount();
+
+    // The chunks in flight, in the order of the file.
+    // A finished chunk waits here until the chunks before it are written.
+    // Their number is bounded, so the memory still doesn't grow with the size of the file.
+    struct InFlight {
+        std::vector<Statement> stmts;
+        ChunkResult res;
+        std::shared_future<void> done;
+    };
+    std::deque<std::unique_ptr<InFlight>> queue;
+    bool has_error = false;
+    // with -time-trace, the worker threads record their chunks as well
+    bool trace = timeTraceProfilerEnabled();
+    auto writeFront = [&] {
+        queue.front()->done.wait();
+        has_error |= writeResult(queue.front()->res);
+        queue.pop_front();
+    };
+
+    Splitter splitter(text, opts_.chunk_size, opts_.bundle);
+    std::vector<Statement> stmts;
+    size_t chunk = 0;
+    splitter.next(stmts);
+    do {
+        auto job = std::make_unique<InFlight>();
+        job->stmts = std::move(stmts);
+        InFlight *j = job.get();
+        size_t n = chunk++;
+        j->done = pool.async([this, j, n, trace] {
+            TraceThread trace_thread(trace);
+            compileChunk(j->stmts, n, j->res);
+        });
+        queue.push_back(std::move(job));
+        if (queue.size() >= 2 * threads)
+            writeFront();
+    } while (splitter.next(stmts));
+    while (!queue.empty())
+        writeFront();
+    return has_error;
+}
+
+void FileCompiler::compileChunk(ArrayRef<Statement> stmts, size_t chunk, ChunkResult &res) const {
+    raw_string_ostream diags(res.diags);
+    // each chunk has its own target machine, they are not shared between threads
+    // a fused kernel is vectorized for the target even when only its IR is printed, like -batch
+    std::unique_ptr<ObjectEmitter> emitter;
+    if (opts_.output_kind != IR || opts_.fuse) {
+        emitter = ObjectEmitter::create(opts_.output_kind == SharedObject, opts_.opt_level, opts_.target, diags);
+        if (!emitter) {
+            res.has_error = true;
+            return;
+        }
+    }
+
+    // the trees of the chunk, and the IR built for them
+    ASTContext ast_ctx;
+    LLVMContext ctx;
+    auto m = std::make_unique<Module>("calc.expr", ctx);
+    if (emitter)
+        emitter->prepare(*m);
+
+    {
+        // the statements are small, so their phases are timed together
+        PhaseTimer timer("frontend", "Front end and IR construction");
+        CodeGen code_generator(opts_.target);
+        std::vector<Function *> fns;
+        std::vector<AST *> trees; // with fuse
+        for (const Statement &stmt : stmts) {
+            Lexer lex(stmt.text);
+            Parser parser(lex, ast_ctx);
+            parser.setDiagnostics(diags);
+            AST *tree = parser.parse();
+            if (!tree || parser.hasError()) {
+                diags << "calc: " << file_name_ << ":" << stmt.line << ": syntax errors occured\n";
+                res.has_error = true;
+                continue;
+            }
+            Sema semantic(diags);
+            if (semantic.semantic(tree)) {
+                diags << "calc: " << file_name_ << ":" << stmt.line << ": semantic errors occured\n";
+                res.has_error = true;
+                continue;
+            }
+            if (opts_.bundle) {
+                BundleWriter::Formula f;
+                f.name = stmt.name.empty() ? ("expr_" + Twine(stmt.index)).str() : stmt.name.str();
+                f.index = stmt.index;
+                f.num_vars = 0;
+                if (auto *decl = dyn_cast<WithDecl>(tree)) {
+                    f.num_vars = decl->getVars().size();
+                    f.vars = join(decl->getVars(), ",");
+                }
+                res.formulas.push_back(std::move(f));
+            }
+            tree = ConstFold(ast_ctx).fold(tree);
+            if (opts_.fuse) {
+                trees.push_back(tree);
+                continue;
+            }
+            Function *fn = code_generator.compileFunction(tree, "calc_expr_" + Twine(stmt.index), *m,
+                                                          /*safe*/opts_.bundle);
+            // only the table of the bundle refers to the functions
+            if (opts_.bundle)
+                fn->setVisibility(GlobalValue::HiddenVisibility);
+            fns.push_back(fn);
+        }
+        if (opts_.fuse) {
+            // without all the expressions, the outputs would not match the lines of the file
+            if (res.has_error)
+                return;
+            m = code_generator.compileFused(trees, ctx);
+            if (emitter)
+                emitter->prepare(*m);
+            fns.push_back(m->getFunction("calc_eval_fused"));
+        }
+        if (opts_.multiversion)
+            MultiVersion::apply(*m, fns);
+    }
+    MemStats::noteArena("ast (per chunk)", ast_ctx.getBytesAllocated());
+
+    if (Optimizer(opts_.opt_level, opts_.passes).run(*m, emitter ? &emitter->getTargetMachine() : nullptr, diags)) {
+        res.has_error = true;
+        return;
+    }
+    if (opts_.output_kind != IR) {
+        res.has_error |= emitter->emit(*m, getChunkFileName(chunk));
+        return;
+    }
+    raw_string_ostream ir(res.ir);
+    m->print(ir, nullptr);
+}
+
+// calc.expr.o, calc.expr.1.o, calc.expr.2.o, ...
+std::string FileCompiler::getChunkFileName(size_t chunk) const {
+    if (chunk == 0)
+        return opts_.output;
+    StringRef ext = sys::path::extension(opts_.output);
+    StringRef stem = StringRef(opts_.output).drop_back(ext.size());
+    return (stem + "." + Twine(chunk) + ext).str();
+}
+
+std::vector<std::string> FileCompiler::getObjectFiles() const {
+    std::vector<std::string> files;
+    for (size_t chunk = 0; chunk != num_chunks_; ++chunk)
+        files.push_back(getChunkFileName(chunk));
+    return files;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "bundle.h"
+#include "target_cpu.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <string>
+#include <vector>
+
+// Compiles a file with many expressions, one per line or separated by ';'.
+// The i-th expression of the file (counting from 0) becomes the function
+//     int32_t calc_expr_<i>(const int32_t *vars)
+// see CodeGen::compileFunction().
+//
+// The file is memory-mapped and split into expressions as it is read.
+// The expressions are compiled in chunks of a bounded number of expressions,
+//     each chunk with a fresh ASTContext, LLVMContext and Module which are released afterwards,
+//     so the memory used depends on the chunk size and not on the size of the file.
+// Each chunk is printed as IR or emitted as an object file of its own:
+//     the first one to the output file name, the next ones to <name>.1.o, <name>.2.o, ...
+//
+// With bundle, a line may start with the name of its formula, "name = expr",
+//     the functions are hidden and compute without undefined behavior,
+//     and the formulas are collected for BundleWriter.
+//
+// With fuse, the file is a group of expressions which are evaluated over the same rows:
+//     they are compiled in one chunk, into the batch kernel calc_eval_fused which reads
+//     each variable once for all of them. The k-th expression of the file is the k-th output.
+//
+// The chunks don't share any state, so with more than one thread they are compiled in parallel,
+//     from parsing to the emission of the object file.
+// The IR and the error messages of a chunk are buffered and written in the order of the chunks,
+//     so the output doesn't depend on the number of threads.
+class FileCompiler {
+public:
+    enum OutputKind { IR, Object, SharedObject };
+
+    struct Options {
+        OutputKind output_kind = IR;
+        std::string output;       // the object file name for Object and SharedObject
+        unsigned opt_level = 0;
+        std::string passes;
+        size_t chunk_size = 1024; // expressions per module
+        unsigned threads = 1;     // 0 means one per hardware thread
+        bool bundle = false;      // the objects are linked into a bundle (see BundleWriter)
+        TargetCPU target;         // -mcpu and -mattr
+        bool multiversion = false; // each function is an ifunc (see MultiVersion)
+        bool fuse = false;        // all the expressions go into one kernel (see CodeGen::compileFused())
+    };
+
+    // an expression from the file
+    struct Statement {
+        llvm::StringRef text;
+        size_t index; // the number in the name of the function
+        size_t line;
+        llvm::StringRef name; // "name = expr", empty if the expression has no name
+    };
+
+    // what a chunk leaves behind until it is its turn to be written
+    struct ChunkResult {
+        std::string ir;    // the printed module, for IR output
+        std::string diags; // the error messages
+        std::vector<BundleWriter::Formula> formulas; // with bundle
+        bool has_error = false;
+    };
+
+private:
+    Options opts_;
+    std::string file_name_;
+    size_t num_chunks_ = 0;
+    std::vector<BundleWriter::Formula> formulas_;
+
+    // compiles the chunk with the given number, may be called from any thread
+    void compileChunk(llvm::ArrayRef<Statement> stmts, size_t chunk, ChunkResult &res) const;
+    std::string getChunkFileName(size_t chunk) const;
+    // writes the IR and the messages of a chunk, returns true if it had an error
+    bool writeResult(ChunkResult &res);
+
+    // splits the text into chunks and compiles them, returns true if an error occurred
+    bool compileSerial(llvm::StringRef text);
+    bool compileParallel(llvm::StringRef text);
+
+public:
+    FileCompiler(const Options &opts) : opts_(opts) {}
+
+    // compiles all expressions of the file, returns true if an error occurred
+    bool run(llvm::StringRef file_name);
+
+    // the same for expressions which are already in memory, file_name is used in the messages
+    bool compile(llvm::StringRef text, llvm::StringRef file_name);
+
+    // with bundle, the formulas in the order of the file, and the object files of the chunks
+    const std::vector<BundleWriter::Formula> &getFormulas() const { return formulas_; }
+    std::vector<std::string> getObjectFiles() const;
+};
@@ -0,0 +1,116 @@
+#include "jit.h"
+#include "code_gen.h"
+#include "expr_cache.h"
+#include "optimizer.h"
+#include "phase_timer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// the runtime functions from rtcalc.c
+extern "C" {
+int calc_read(char *s);
+void calc_write(int v);
+}
+
+Expected<std::unique_ptr<CalcJIT>> CalcJIT::create(unsigned opt_level, ObjectCache *cache) {
+    // the JIT generates code for the host, so only the native target is needed
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    auto jtmb = JITTargetMachineBuilder::detectHost();
+    if (!jtmb)
+        return jtmb.takeError();
+    jtmb->setCodeGenOptLevel(opt_level == 0 ? CodeGenOpt::None :
+                             opt_level == 1 ? CodeGenOpt::Less :
+                             opt_level == 2 ? CodeGenOpt::Default :
+                                              CodeGenOpt::Aggressive);
+    auto tm = jtmb->createTargetMachine();
+    if (!tm)
+        return tm.takeError();
+
+    auto jit = LLJITBuilder()
+        .setJITTargetMachineBuilder(std::move(*jtmb))
+        .setCompileFunctionCreator([cache](JITTargetMachineBuilder jtmb)
+                -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+            // the default compiler, with the object cache plugged in
+            return std::make_unique<ConcurrentIRCompiler>(std::move(jtmb), cache);
+        })
+        .create();
+    if (!jit)
+        return jit.takeError();
+
+    // The generated code calls calc_read() and calc_write().
+    // Rather than searching the whole process for them, both symbols are
+    // defined as absolute addresses of the functions linked into calc:
+    JITDylib &jd = (*jit)->getMainJITDylib();
+    SymbolMap runtime;
+    runtime[(*jit)->mangleAndIntern("calc_read")] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(&calc_read), JITSymbolFlags::Exported);
+    runtime[(*jit)->mangleAndIntern("calc_write")] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(&calc_write), JITSymbolFlags::Exported);
+    if (Error err = jd.define(absoluteSymbols(std::move(runtime))))
+        return err;
+
+    return std::unique_ptr<CalcJIT>(new CalcJIT(std::move(*jit), std::move(*tm)));
+}
+
+ResourceTrackerSP CalcJIT::createTracker() {
+    return jit_->getMainJITDylib().createResourceTracker();
+}
+
+Error CalcJIT::addModule(ThreadSafeModule tsm, ResourceTrackerSP tracker) {
+    if (!tracker)
+        return jit_->addIRModule(std::move(tsm));
+    return jit_->addIRModule(std::move(tracker), std::move(tsm));
+}
+
+Error CalcJIT::addObject(std::unique_ptr<MemoryBuffer> obj, ResourceTrackerSP tracker) {
+    if (!tracker)
+        return jit_->addObjectFile(std::move(obj));
+    return jit_->addObjectFile(std::move(tracker), std::move(obj));
+}
+
+Expected<JITTargetAddress> CalcJIT::addFunction(AST *tree, StringRef name, unsigned opt_level,
+                                                ResourceTrackerSP tracker, StringRef cache_key) {
+    auto ctx = std::make_unique<LLVMContext>();
+    auto m = std::make_unique<Module>("calc.expr", *ctx);
+    CodeGen().compileFunction(tree, name, *m, /*safe*/true);
+    if (!cache_key.empty())
+        ExprCache::setModuleKey(*m, cache_key);
+    m->setDataLayout(getDataLayout());
+    m->setTargetTriple(tm_->getTargetTriple().getTriple());
+    {
+        std::lock_guard<std::mutex> lock(optimizer_mutex_);
+        if (Optimizer(opt_level, "").run(*m, tm_.get()))
+            return createStringError(inconvertibleErrorCode(), "the optimizer failed");
+    }
+    // the JIT compiles and links the modules of several threads at once
+    if (Error err = addModule(ThreadSafeModule(std::move(m), std::move(ctx)), std::move(tracker)))
+        return err;
+    return lookup(name);
+}
+
+Expected<JITTargetAddress> CalcJIT::lookup(StringRef name) {
+    // the first lookup of a symbol compiles its module
+    PhaseTimer timer("jit", "JIT materialization");
+    auto sym = jit_->lookup(name);
+    if (!sym)
+        return sym.takeError();
+    return sym->getAddress();
+}
+
+Expected<int> CalcJIT::runMain() {
+    auto addr = lookup("main");
+    if (!addr)
+        return addr.takeError();
+    // the generated main() has the usual signature, but ignores its arguments
+    auto main_fn = jitTargetAddressToFunction<int (*)(int, char **)>(*addr);
+    return main_fn(0, nullptr);
+}
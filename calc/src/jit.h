@@ -0,0 +1,66 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include <mutex>
+
+class AST;
+
+// Instead of printing the IR and running llc and clang on it (see run.sh),
+// the module can be compiled and executed in-process with ORC's LLJIT.
+// calc_read() and calc_write() are resolved against the runtime in rtcalc.c,
+// which is linked into the calc executable itself.
+class CalcJIT {
+    std::unique_ptr<llvm::orc::LLJIT> jit_;
+    // describes the same host target as the JIT, used to optimize modules for it
+    std::unique_ptr<llvm::TargetMachine> tm_;
+    // the optimizer uses tm_, which is not meant to be shared between threads
+    std::mutex optimizer_mutex_;
+
+    CalcJIT(std::unique_ptr<llvm::orc::LLJIT> jit, std::unique_ptr<llvm::TargetMachine> tm)
+        : jit_(std::move(jit)), tm_(std::move(tm)) {}
+
+public:
+    // opt_level (0-3) selects the backend optimizations of the JIT compiler
+    // If a cache is given, the compiler asks it for the object of each module before compiling,
+    //     and hands it each object it compiles (see ExprCache).
+    static llvm::Expected<std::unique_ptr<CalcJIT>> create(unsigned opt_level,
+                                                           llvm::ObjectCache *cache = nullptr);
+
+    llvm::TargetMachine &getTargetMachine() { return *tm_; }
+
+    // modules must use this data layout before they are added
+    const llvm::DataLayout &getDataLayout() const { return jit_->getDataLayout(); }
+
+    // A tracker owns the code of the modules and objects added with it,
+    //     the code is freed by removing the tracker (ResourceTracker::remove()).
+    // Without a tracker, the code stays as long as the JIT.
+    llvm::orc::ResourceTrackerSP createTracker();
+
+    llvm::Error addModule(llvm::orc::ThreadSafeModule tsm, llvm::orc::ResourceTrackerSP tracker = nullptr);
+
+    // adds an object file compiled earlier for this JIT, e.g. one from the cache
+    llvm::Error addObject(std::unique_ptr<llvm::MemoryBuffer> obj,
+                          llvm::orc::ResourceTrackerSP tracker = nullptr);
+
+    // Compiles tree to the function name (see CodeGen::compileFunction(), with safe arithmetic)
+    //     in a module of its own, optimizes it at opt_level, adds it with tracker
+    //     and returns the address of the function.
+    // If cache_key is not empty, the module is marked with it for the object cache (see ExprCache).
+    // It may be called from several threads at once.
+    llvm::Expected<llvm::JITTargetAddress> addFunction(AST *tree, llvm::StringRef name, unsigned opt_level,
+                                                       llvm::orc::ResourceTrackerSP tracker,
+                                                       llvm::StringRef cache_key = "");
+
+    // returns the in-process address of a JIT'd symbol, compiling it on first use
+    llvm::Expected<llvm::JITTargetAddress> lookup(llvm::StringRef name);
+
+    // runs the main() function generated by ToIRVisitor::run
+    llvm::Expected<int> runMain();
+};
@@ -1,48 +1,281 @@
 #include "lexer.h"
+#include "llvm/Support/Endian.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CALC_LEXER_X86 1
+#include <immintrin.h>
+#else
+#define CALC_LEXER_X86 0
+#endif
 
 namespace charinfo{
 
-LLVM_READNONE inline bool isWhitespace(char c) {
-    return c == ' '  ||
-           c == '\t' || 
-           c == '\f' ||
-           c == '\v' || 
-           c == '\r' || 
-           c == '\n';
+// Every character is classified by one lookup in a 256 entry table,
+// instead of a chain of comparisons.
+enum CharClass : uint8_t {
+    Whitespace = 1,
+    Letter = 2,
+    Digit = 4
+};
+
+struct CharTable {
+    uint8_t classes[256];
+
+    constexpr CharTable() : classes() {
+        for (int c = 0; c < 256; ++c) {
+            uint8_t k = 0;
+            if (c == ' ' || c == '\t' || c == '\f' || c == '\v' || c == '\r' || c == '\n')
+                k |= Whitespace;
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+                k |= Letter;
+            if (c >= '0' && c <= '9')
+                k |= Digit;
+            classes[c] = k;
+        }
+    }
+};
+
+constexpr CharTable Table;
+
+LLVM_READNONE inline bool is(char c, CharClass k) {
+    return Table.classes[static_cast<unsigned char>(c)] & k;
+}
+
+LLVM_READNONE inline bool isWhitespace(char c) { return is(c, Whitespace); }
+LLVM_READNONE inline bool isDigit(char c) { return is(c, Digit); }
+LLVM_READNONE inline bool isLetter(char c) { return is(c, Letter); }
+
+} // namespace charinfo
+
+
+// Each scanner returns the first position in [p, end) whose character is not of the class K.
+// The vector variants classify a whole block with a few compares,
+// and find the end of the run with a movemask and count-trailing-zeros.
+// The last, partial block is handled by the scalar variant, so nothing beyond end is read.
+// Most runs in ordinary input are only a few bytes long, so the vector variants
+// first look at a few bytes one at a time, and only then switch to whole blocks.
+
+namespace {
+
+using ScanFn = const char *(*)(const char *p, const char *end);
+
+template <charinfo::CharClass K>
+const char *scanScalar(const char *p, const char *end) {
+    while (p != end && charinfo::is(*p, K))
+        ++p;
+    return p;
 }
 
-LLVM_READNONE inline bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+// the number of bytes looked at before the vector loop starts
+constexpr unsigned ShortRun = 8;
+
+// Scans at most ShortRun bytes. Returns true if the run ended there.
+template <charinfo::CharClass K>
+inline bool scanShortRun(const char *&p, const char *end) {
+    for (unsigned i = 0; i < ShortRun; ++i, ++p) {
+        if (p == end || !charinfo::is(*p, K))
+            return true;
+    }
+    return false;
 }
 
-LLVM_READNONE inline bool isLetter(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z');
+#if CALC_LEXER_X86
+
+// lanes which are <= n, as unsigned bytes
+inline __m128i lessEqualU8(__m128i x, char n) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(n)), x);
 }
 
-} // namespace charinfo
+template <charinfo::CharClass K>
+inline __m128i classify16(__m128i c) {
+    switch (K) {
+        case charinfo::Whitespace: // ' ' or '\t' .. '\r'
+            return _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                lessEqualU8(_mm_sub_epi8(c, _mm_set1_epi8('\t')), '\r' - '\t'));
+        case charinfo::Letter: // setting bit 5 maps 'A'..'Z' to 'a'..'z'
+            return lessEqualU8(_mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a')),
+                               'z' - 'a');
+        case charinfo::Digit:
+            return lessEqualU8(_mm_sub_epi8(c, _mm_set1_epi8('0')), 9);
+    }
+    return _mm_setzero_si128();
+}
 
-void Lexer::next(Token &token) {
-    while (*buffer_ptr_ && charinfo::isWhitespace(*buffer_ptr_)) {
-        ++buffer_ptr_;
+template <charinfo::CharClass K>
+const char *scanSSE2(const char *p, const char *end) {
+    if (scanShortRun<K>(p, end))
+        return p;
+    while (end - p >= 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        unsigned outside = ~unsigned(_mm_movemask_epi8(classify16<K>(c))) & 0xFFFF;
+        if (outside)
+            return p + __builtin_ctz(outside);
+        p += 16;
     }
-    if (!*buffer_ptr_) {
-        token.kind_ = Token::eoi;
+    return scanScalar<K>(p, end);
+}
+
+__attribute__((target("avx2")))
+inline __m256i lessEqualU8(__m256i x, char n) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(n)), x);
+}
+
+template <charinfo::CharClass K>
+__attribute__((target("avx2")))
+inline __m256i classify32(__m256i c) {
+    switch (K) {
+        case charinfo::Whitespace:
+            return _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                   lessEqualU8(_mm256_sub_epi8(c, _mm256_set1_epi8('\t')), '\r' - '\t'));
+        case charinfo::Letter:
+            return lessEqualU8(_mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a')),
+                               'z' - 'a');
+        case charinfo::Digit:
+            return lessEqualU8(_mm256_sub_epi8(c, _mm256_set1_epi8('0')), 9);
+    }
+    return _mm256_setzero_si256();
+}
+
+template <charinfo::CharClass K>
+__attribute__((target("avx2")))
+const char *scanAVX2(const char *p, const char *end) {
+    if (scanShortRun<K>(p, end))
+        return p;
+    // runs of medium length end within the next 16 bytes
+    if (end - p >= 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        unsigned outside = ~unsigned(_mm_movemask_epi8(classify16<K>(c))) & 0xFFFF;
+        if (outside)
+            return p + __builtin_ctz(outside);
+        p += 16;
+    }
+    while (end - p >= 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        unsigned outside = ~unsigned(_mm256_movemask_epi8(classify32<K>(c)));
+        if (outside)
+            return p + __builtin_ctz(outside);
+        p += 32;
+    }
+    return scanSSE2<K>(p, end);
+}
+
+#endif // CALC_LEXER_X86
+
+} // namespace
+
+// Numbers are decoded with SWAR (SIMD within a register): eight digits are loaded
+// into one 64-bit word, and three multiply-shift steps combine them into pairs,
+// quads and finally the 8-digit value, instead of one multiply-add per digit.
+static uint64_t decodeEightDigits(uint64_t chunk) {
+    // the first digit is in the lowest byte; 0x0F maps '0'..'9' to 0..9
+    chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+
+// decodes the digits in [p, p + len), the arithmetic wraps around like the generated code
+static int32_t decodeNumber(const char *p, size_t len, const char *buffer_end) {
+    uint64_t value = 0;
+    // the leading digits, so that the rest is a multiple of eight
+    size_t head = len % 8;
+    if (head) {
+        uint64_t chunk = 0;
+        if (buffer_end - p >= 8) {
+            // the bytes after the digits are shifted out, zero bytes count as leading zeros
+            chunk = llvm::support::endian::read64le(p) << (8 * (8 - head));
+        }
+        else {
+            char bytes[8] = {0};
+            std::memcpy(bytes + 8 - head, p, head);
+            chunk = llvm::support::endian::read64le(bytes);
+        }
+        value = decodeEightDigits(chunk);
+        p += head;
+        len -= head;
+    }
+    for (; len; len -= 8, p += 8)
+        value = value * 100000000 + decodeEightDigits(llvm::support::endian::read64le(p));
+    return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+struct Lexer::Scanners {
+    ScanFn whitespace;
+    ScanFn letters;
+    ScanFn digits;
+};
+
+static const Lexer::Scanners ScalarScanners = {
+    scanScalar<charinfo::Whitespace>, scanScalar<charinfo::Letter>, scanScalar<charinfo::Digit>
+};
+
+#if CALC_LEXER_X86
+static const Lexer::Scanners SSE2Scanners = {
+    scanSSE2<charinfo::Whitespace>, scanSSE2<charinfo::Letter>, scanSSE2<charinfo::Digit>
+};
+static const Lexer::Scanners AVX2Scanners = {
+    scanAVX2<charinfo::Whitespace>, scanAVX2<charinfo::Letter>, scanAVX2<charinfo::Digit>
+};
+#endif
+
+bool Lexer::isSupported(ScanKind kind) {
+    switch (kind) {
+        case ScanKind::Best:
+        case ScanKind::Scalar:
+            return true;
+#if CALC_LEXER_X86
+        case ScanKind::SSE2:
+            return __builtin_cpu_supports("sse2");
+        case ScanKind::AVX2:
+            return __builtin_cpu_supports("avx2");
+#else
+        default:
+            return false;
+#endif
+    }
+    return false;
+}
+
+// the requested scanner, or the widest supported one below it
+static const Lexer::Scanners *selectScanners(Lexer::ScanKind kind) {
+#if CALC_LEXER_X86
+    if ((kind == Lexer::ScanKind::Best || kind == Lexer::ScanKind::AVX2) &&
+        Lexer::isSupported(Lexer::ScanKind::AVX2))
+        return &AVX2Scanners;
+    if (kind != Lexer::ScanKind::Scalar && Lexer::isSupported(Lexer::ScanKind::SSE2))
+        return &SSE2Scanners;
+#endif
+    return &ScalarScanners;
+}
+
+Lexer::Lexer(const llvm::StringRef &buffer, ScanKind kind) {
+    // llvm::outs() << "Lexer::Lexer\n";
+    buffer_start_ = buffer.begin();
+    buffer_ptr_ = buffer_start_;
+    buffer_end_ = buffer.end();
+    scanners_ = selectScanners(kind);
+}
+
+void Lexer::next(Token &token) {
+    buffer_ptr_ = scanners_->whitespace(buffer_ptr_, buffer_end_);
+    // the end of the buffer, or an embedded terminating zero
+    if (buffer_ptr_ == buffer_end_ || !*buffer_ptr_) {
+        formToken(token, buffer_ptr_, Token::eoi);
         return;
     }
     if (charinfo::isLetter(*buffer_ptr_)) {
-        const char *end = buffer_ptr_ + 1;
-        while (charinfo::isLetter(*end))
-            ++end;
-        llvm::StringRef name(buffer_ptr_, end - buffer_ptr_);
-        Token::TokenKind kind = name == "with" ? Token::KW_with : Token::ident;
+        const char *end = scanners_->letters(buffer_ptr_ + 1, buffer_end_);
+        // "with" is the only keyword, so a length check rules out most identifiers
+        Token::TokenKind kind = Token::ident;
+        if (end - buffer_ptr_ == 4 && std::memcmp(buffer_ptr_, "with", 4) == 0)
+            kind = Token::KW_with;
         formToken(token, end, kind);
         return;
     }
     else if (charinfo::isDigit(*buffer_ptr_)) {
-        const char *end = buffer_ptr_ + 1;
-        while (charinfo::isLetter(*end))
-            ++end;
+        const char *end = scanners_->digits(buffer_ptr_ + 1, buffer_end_);
+        token.value_ = decodeNumber(buffer_ptr_, end - buffer_ptr_, buffer_end_);
         formToken(token, end, Token::number);
         return;
     }
@@ -57,7 +290,7 @@ void Lexer::next(Token &token) {
             CASE('(', Token::Token::l_paren);
             CASE(')', Token::Token::r_paren);
             CASE(':', Token::colon);
-            CASE(';', Token::comma);
+            CASE(',', Token::comma);
             default:
                 formToken(token, buffer_ptr_ + 1, Token::unknown);
         }
@@ -70,4 +303,22 @@ void Lexer::formToken(Token &tok, const char *tok_end, Token::TokenKind kind) {
     tok.kind_ = kind;
     tok.text_ = llvm::StringRef(buffer_ptr_, tok_end - buffer_ptr_);
     buffer_ptr_ = tok_end;
-}
\ No newline at end of file
+}
+
+
+bool Lexer::tokenize(TokenBuffer &tokens) {
+    if (buffer_end_ - buffer_start_ > UINT32_MAX) {
+        llvm::errs() << "Input too large to be tokenized in advance\n";
+        return true;
+    }
+    tokens.source_ = llvm::StringRef(buffer_start_, buffer_end_ - buffer_start_);
+    Token tok;
+    do {
+        next(tok);
+        tokens.tokens_.push_back({tok.kind_,
+                                  uint32_t(tok.text_.data() - buffer_start_),
+                                  uint32_t(tok.text_.size()),
+                                  tok.is(Token::number) ? tok.value_ : 0});
+    } while (!tok.is(Token::eoi));
+    return false;
+}
@@ -13,10 +13,15 @@
 #include "llvm/Support/raw_ostream.h"
     // print log
 
+#include <cstdint>
+#include <vector>
+
 class Lexer;
+class TokenBuffer;
 
 class Token {
     friend class Lexer;
+    friend class TokenBuffer;
 
 public:
     enum TokenKind : unsigned short {
@@ -38,10 +43,14 @@ public:
 private:
     TokenKind kind_; // a unique number to each token to make handling them easier
     llvm::StringRef text_; // points to the start of the text of the token
+    int32_t value_ = 0; // the value of a number, decoded by the lexer
 
 public:
     TokenKind getKind() const { return kind_; }
     llvm::StringRef getText() const { return text_;}
+    // Numbers are decoded once by the lexer, so later phases don't parse the text again.
+    // A number which doesn't fit into 32 bits wraps around.
+    int32_t getValue() const { return value_; }
 
     bool is(TokenKind k) const { return kind_ == k; }
     bool isOneOf(TokenKind k1, TokenKind k2) const { return is(k1) || is(k2); }
@@ -54,19 +63,68 @@ public:
 };
 
 class Lexer{
+public:
+    // How runs of whitespace, letters and digits are scanned.
+    // The vector variants look at 16 (SSE2) or 32 (AVX2) bytes at a time,
+    //     Best picks the widest one the CPU supports at runtime.
+    // The scalar variant classifies one byte at a time through a lookup table.
+    enum class ScanKind { Best, Scalar, SSE2, AVX2 };
+
+    // the functions which find the end of a run of one character class
+    struct Scanners;
+
+private:
     const char *buffer_start_;
     const char *buffer_ptr_;
+    const char *buffer_end_;
+    const Scanners *scanners_;
 
 public:
-    Lexer(const llvm::StringRef &buffer) {
-        // llvm::outs() << "Lexer::Lexer\n";
-        buffer_start_ = buffer.begin();
-        buffer_ptr_ = buffer_start_;
-    }
+    Lexer(const llvm::StringRef &buffer, ScanKind kind = ScanKind::Best);
 
     void next(Token &token);
 
+    // Lexes the whole input in one pass and appends the tokens, including eoi, to the buffer.
+    // Returns true if the input is too large for the 32-bit offsets of the buffer.
+    bool tokenize(TokenBuffer &tokens);
+
+    // true if the CPU (and the compiler) support this kind of scanner
+    static bool isSupported(ScanKind kind);
+
 private:
     void formToken(Token &result, const char *tok_end, Token::TokenKind kind);
 
-};
\ No newline at end of file
+};
+
+
+// A pre-tokenized input: the lexer fills a contiguous array in one pass,
+// and the parser then walks it with an index instead of calling back into the lexer.
+// An entry is 16 bytes: kind, offset and length as 32-bit fields, and the decoded value of a number.
+// Besides being cache friendly, the array allows arbitrary lookahead.
+class TokenBuffer {
+    friend class Lexer;
+
+public:
+    struct Entry {
+        uint32_t kind;
+        uint32_t offset; // from the start of the input
+        uint32_t length;
+        int32_t value;
+    };
+
+private:
+    llvm::StringRef source_;
+    std::vector<Entry> tokens_;
+
+public:
+    size_t size() const { return tokens_.size(); }
+    const Entry &operator[](size_t i) const { return tokens_[i]; }
+
+    // Unpacks entry i into a Token. Past the end, this is the final eoi token.
+    void get(size_t i, Token &token) const {
+        const Entry &e = tokens_[i < tokens_.size() ? i : tokens_.size() - 1];
+        token.kind_ = static_cast<Token::TokenKind>(e.kind);
+        token.text_ = source_.substr(e.offset, e.length);
+        token.value_ = e.value;
+    }
+};
@@ -0,0 +1,62 @@
+#include "libcalc.h"
+#include "const_fold.h"
+#include "jit.h"
+#include "parser.h"
+#include "sema.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+struct CompiledExpr::Code {
+    std::shared_ptr<CalcJIT> jit;
+    orc::ResourceTrackerSP tracker;
+
+    explicit Code(std::shared_ptr<CalcJIT> owner) : jit(std::move(owner)), tracker(jit->createTracker()) {}
+
+    // the members are destroyed after this, so the JIT is still there when the code is removed
+    ~Code() {
+        if (Error err = tracker->remove())
+            logAllUnhandledErrors(std::move(err), errs(), "calc: ");
+    }
+};
+
+Expected<std::unique_ptr<ExprCompiler>> ExprCompiler::create(unsigned opt_level) {
+    if (opt_level > 3)
+        return createStringError(inconvertibleErrorCode(), "invalid optimization level -O%u", opt_level);
+    auto jit = CalcJIT::create(opt_level);
+    if (!jit)
+        return jit.takeError();
+    return std::unique_ptr<ExprCompiler>(new ExprCompiler(std::move(*jit), opt_level));
+}
+
+Expected<CompiledExpr> ExprCompiler::compile(StringRef expr) {
+    std::string errors;
+    raw_string_ostream diags(errors);
+
+    // the tree only lives until the IR is built
+    ASTContext ast_ctx;
+    Lexer lex(expr);
+    Parser parser(lex, ast_ctx);
+    parser.setDiagnostics(diags);
+    AST *tree = parser.parse();
+    if (!tree || parser.hasError()) {
+        diags << "syntax errors occured";
+        return createStringError(inconvertibleErrorCode(), diags.str());
+    }
+    if (Sema(diags).semantic(tree)) {
+        diags << "semantic errors occured";
+        return createStringError(inconvertibleErrorCode(), diags.str());
+    }
+    size_t num_vars = 0;
+    if (auto *decl = dyn_cast<WithDecl>(tree))
+        num_vars = decl->getVars().size();
+    tree = ConstFold(ast_ctx).fold(tree);
+
+    std::string name = ("calc_expr_" + Twine(next_id_.fetch_add(1, std::memory_order_relaxed))).str();
+    auto code = std::make_shared<CompiledExpr::Code>(jit_);
+    auto addr = jit_->addFunction(tree, name, opt_level_, code->tracker);
+    if (!addr)
+        return addr.takeError();
+    return CompiledExpr(jitTargetAddressToFunction<CompiledExpr::Fn>(*addr), num_vars, std::move(code));
+}
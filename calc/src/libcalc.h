@@ -0,0 +1,81 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class CalcJIT;
+
+// The C++ API of the library calcCore, for programs which evaluate expressions on their hot paths
+//     and can't spawn calc or go through the compile server for each of them.
+//
+//     auto compiler = ExprCompiler::create(/*opt_level*/2);   // once per process
+//     Expected<CompiledExpr> e = (*compiler)->compile("with price, qty: price * qty");
+//     int32_t vars[] = {3, 4};
+//     int32_t result = e->evaluate(vars);                     // 12, from any thread
+//
+// An expression is compiled once, to native code in the JIT of the compiler.
+// The CompiledExpr is the address of that code and the number of variables, nothing else:
+//     evaluate() is a plain call, it takes no lock and writes no shared memory,
+//     so any number of threads may evaluate the same handle at once.
+// The code computes with wrap-around and x/0 is 0, like that of the server,
+//     so no formula can crash the program which evaluates it.
+//
+// The handles of an expression share the ownership of its code and of the JIT,
+//     the code stays valid as long as a handle to it exists, even after the ExprCompiler is gone.
+// When the last handle goes, the code is removed from the JIT. Copying a handle costs a reference count.
+
+// an expression compiled to native code
+class CompiledExpr {
+public:
+    using Fn = int32_t (*)(const int32_t *vars);
+
+private:
+    // the code of the expression in the JIT, it is freed with the last handle
+    struct Code;
+
+    Fn fn_ = nullptr;
+    size_t num_vars_ = 0;
+    std::shared_ptr<const Code> code_; // keeps the code alive, not used by evaluate()
+
+    friend class ExprCompiler;
+    CompiledExpr(Fn fn, size_t num_vars, std::shared_ptr<const Code> code)
+        : fn_(fn), num_vars_(num_vars), code_(std::move(code)) {}
+
+public:
+    CompiledExpr() = default;
+
+    explicit operator bool() const { return fn_ != nullptr; }
+
+    // the variables of the "with" declaration, in their order
+    size_t getNumVars() const { return num_vars_; }
+
+    // vars holds getNumVars() values, it may be nullptr for an expression without variables
+    int32_t evaluate(const int32_t *vars) const { return fn_(vars); }
+
+    // the function itself, e.g. to call it from code which doesn't know CompiledExpr
+    Fn getFunction() const { return fn_; }
+};
+
+// Compiles expressions into one JIT.
+// compile() may be called from several threads at once.
+class ExprCompiler {
+    std::shared_ptr<CalcJIT> jit_;
+    unsigned opt_level_;
+    // the functions are numbered, so that each expression gets its own symbol
+    std::atomic<uint64_t> next_id_{0};
+
+    ExprCompiler(std::shared_ptr<CalcJIT> jit, unsigned opt_level)
+        : jit_(std::move(jit)), opt_level_(opt_level) {}
+
+public:
+    // opt_level (0-3) selects the optimizations, like -O of calc
+    static llvm::Expected<std::unique_ptr<ExprCompiler>> create(unsigned opt_level = 2);
+
+    // Returns the syntax and semantic errors of the expression as the message of the error.
+    // Each call compiles the expression again, a program which sees the same formula often
+    //     keeps the handle.
+    llvm::Expected<CompiledExpr> compile(llvm::StringRef expr);
+};
@@ -0,0 +1,114 @@
+#include "mem_stats.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sys/resource.h>
+
+using namespace llvm;
+
+// Plain thread-local counters: an allocation costs two increments and no synchronization.
+static thread_local uint64_t thread_allocations = 0;
+static thread_local uint64_t thread_bytes = 0;
+
+void MemStats::countAllocation(size_t size) {
+    ++thread_allocations;
+    thread_bytes += size;
+}
+
+uint64_t MemStats::threadAllocations() { return thread_allocations; }
+uint64_t MemStats::threadAllocatedBytes() { return thread_bytes; }
+
+namespace {
+
+std::atomic<bool> enabled{false};
+// the phases may end on several threads at once, e.g. with -f -j
+std::mutex mutex;
+MemStats::Report collected;
+
+} // namespace
+
+void MemStats::enable() { enabled.store(true, std::memory_order_relaxed); }
+bool MemStats::isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+void MemStats::addPhase(StringRef name, StringRef description, uint64_t allocations, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find_if(collected.phases.begin(), collected.phases.end(),
+                           [&](const Phase &p) { return p.name == name; });
+    if (it == collected.phases.end()) {
+        collected.phases.push_back({name.str(), description.str()});
+        it = collected.phases.end() - 1;
+    }
+    ++it->calls;
+    it->allocations += allocations;
+    it->bytes += bytes;
+}
+
+void MemStats::noteArena(StringRef name, uint64_t bytes) {
+    if (!isEnabled())
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = std::find_if(collected.arenas.begin(), collected.arenas.end(),
+                           [&](const Arena &a) { return a.name == name; });
+    if (it == collected.arenas.end())
+        collected.arenas.push_back({name.str(), bytes});
+    else
+        it->high_water = std::max(it->high_water, bytes);
+}
+
+uint64_t MemStats::getPeakRSS() {
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // in kilobytes on Linux
+    return uint64_t(usage.ru_maxrss) * 1024;
+}
+
+MemStats::Report MemStats::take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Report res = std::move(collected);
+    collected = Report();
+    res.peak_rss = getPeakRSS();
+    return res;
+}
+
+void MemStats::Report::print(raw_ostream &os) const {
+    os << "calc: memory:\n";
+    os << "  phase                                    runs    allocations          bytes  bytes/alloc\n";
+    for (const Phase &p : phases)
+        os << format("  %-36s %8llu %14llu %14llu %12.1f\n", p.description.c_str(),
+                     (unsigned long long)p.calls, (unsigned long long)p.allocations,
+                     (unsigned long long)p.bytes, p.allocations ? double(p.bytes) / p.allocations : 0.0);
+    for (const Arena &a : arenas)
+        os << format("  arena %-30s high-water %14llu bytes\n", a.name.c_str(), (unsigned long long)a.high_water);
+    os << format("  peak RSS %41.1f MB\n", peak_rss / 1048576.0);
+}
+
+void MemStats::Report::printJSON(raw_ostream &os) const {
+    json::OStream json(os, /*IndentSize*/2);
+    json.object([&] {
+        json.attributeArray("phases", [&] {
+            for (const Phase &p : phases) {
+                json.object([&] {
+                    json.attribute("name", p.name);
+                    json.attribute("description", p.description);
+                    json.attribute("calls", int64_t(p.calls));
+                    json.attribute("allocations", int64_t(p.allocations));
+                    json.attribute("bytes", int64_t(p.bytes));
+                });
+            }
+        });
+        json.attributeArray("arenas", [&] {
+            for (const Arena &a : arenas) {
+                json.object([&] {
+                    json.attribute("name", a.name);
+                    json.attribute("high_water_bytes", int64_t(a.high_water));
+                });
+            }
+        });
+        json.attribute("peak_rss_bytes", int64_t(peak_rss));
+    });
+    os << "\n";
+}
+
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Memory accounting for -mem-stats, and for services which embed the compiler
+//     and want to log the memory of each request.
+//
+// The global operator new is replaced (see mem_stats_new.cpp) by one which counts the allocations
+//     and the requested bytes of each thread. This is where the side tables of the ASTContext,
+//     the scope of Sema, the LLVMContext and Module of CodeGen and the backend get their memory.
+// The replacement is part of the calc and calc-bench executables, not of the library calcCore:
+//     a program which embeds the compiler keeps its own operator new, and the counters stay at 0
+//     unless it calls countAllocation() from it.
+// Memory taken from malloc() directly, like the slabs of a BumpPtrAllocator or the growth of a
+//     SmallVector, is not counted. The arenas are reported by their high-water marks instead,
+//     and the peak RSS covers everything.
+//
+// Each PhaseTimer is also a phase here (see phase_timer.h):
+//     with MemStats::enable(), a phase adds the allocations of its thread to the totals of its name.
+// A phase which runs inside another one is counted in both.
+class MemStats {
+public:
+    struct Phase {
+        std::string name;
+        std::string description;
+        uint64_t calls = 0; // how often the phase ran
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+    };
+    struct Arena {
+        std::string name;
+        uint64_t high_water = 0; // the most bytes in use at once
+    };
+    struct Report {
+        std::vector<Phase> phases; // in the order they first ran
+        std::vector<Arena> arenas;
+        uint64_t peak_rss = 0; // in bytes, of the whole process so far
+
+        void print(llvm::raw_ostream &os) const;
+        void printJSON(llvm::raw_ostream &os) const;
+    };
+
+    // counts an allocation of the current thread, called by operator new
+    static void countAllocation(size_t size);
+
+    // the allocations of the current thread since it started, counted whether enabled or not
+    static uint64_t threadAllocations();
+    static uint64_t threadAllocatedBytes();
+
+    // Measures the allocations of the current thread while it exists,
+    //     e.g. around the handling of one request.
+    class Scope {
+        uint64_t allocations_;
+        uint64_t bytes_;
+
+    public:
+        Scope() : allocations_(threadAllocations()), bytes_(threadAllocatedBytes()) {}
+        uint64_t allocations() const { return threadAllocations() - allocations_; }
+        uint64_t bytes() const { return threadAllocatedBytes() - bytes_; }
+    };
+
+    // starts collecting the phases and arenas, before the first phase
+    static void enable();
+    static bool isEnabled();
+
+    // adds one run of a phase, called by PhaseTimer
+    static void addPhase(llvm::StringRef name, llvm::StringRef description, uint64_t allocations,
+                         uint64_t bytes);
+    // records the size of an arena, the largest size is kept
+    static void noteArena(llvm::StringRef name, uint64_t bytes);
+
+    // the peak resident set size of the process in bytes
+    static uint64_t getPeakRSS();
+
+    // returns what was collected so far and starts over, e.g. for the next request
+    static Report take();
+};
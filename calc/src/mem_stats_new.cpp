@@ -0,0 +1,22 @@
+#include "mem_stats.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <cstdlib>
+
+// The operator new of the calc executables, which counts the allocations for MemStats.
+// It is not part of calcCore, so a program which embeds the compiler keeps its own.
+// The aligned forms of operator new are C++17, they are left to the standard library.
+
+static void *countedAlloc(size_t size) {
+    MemStats::countAllocation(size);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    // calc is built without exceptions, like LLVM
+    llvm::report_bad_alloc_error("calc: out of memory");
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
@@ -0,0 +1,175 @@
+#include "multiversion.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+// the variants, from the best to the baseline
+struct Variant {
+    const char *suffix;
+    const char *cpu;
+    unsigned level; // of getCPULevel()
+    const char *vector_width;
+};
+const Variant Variants[] = {
+    {"avx512", "x86-64-v4", 2, "512"},
+    {"avx2", "x86-64-v3", 1, nullptr},
+    {"sse2", "x86-64", 0, nullptr},
+};
+
+// Builds the function
+//     i32 calc.cpu_level()
+// which returns 2 if the CPU and the OS support x86-64-v4, 1 for x86-64-v3 and 0 otherwise.
+// The level is computed once and kept in a global, -1 until then.
+// It is called from the ifunc resolvers, when the library is being relocated,
+//     so it must not depend on anything else: the CPU is asked with inline assembly.
+class CPULevelBuilder {
+    Module &m_;
+    IRBuilder<> builder_;
+    Type *int32_ty_;
+    StructType *regs_ty_;
+
+    // {eax, ebx, ecx, edx} = cpuid(leaf, subleaf)
+    Value *cpuid(unsigned leaf, unsigned subleaf) {
+        FunctionType *fty = FunctionType::get(regs_ty_, {int32_ty_, int32_ty_}, false);
+        InlineAsm *asm_fn = InlineAsm::get(fty, "cpuid", "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}",
+                                           /*hasSideEffects*/false);
+        return builder_.CreateCall(fty, asm_fn, {builder_.getInt32(leaf), builder_.getInt32(subleaf)});
+    }
+
+    // the low half of XCR0, the register states the OS saves on a context switch
+    Value *xgetbv() {
+        StructType *pair_ty = StructType::get(int32_ty_, int32_ty_);
+        FunctionType *fty = FunctionType::get(pair_ty, {int32_ty_}, false);
+        InlineAsm *asm_fn = InlineAsm::get(fty, "xgetbv", "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}",
+                                           /*hasSideEffects*/false);
+        return builder_.CreateExtractValue(builder_.CreateCall(fty, asm_fn, {builder_.getInt32(0)}), 0);
+    }
+
+    // true if all the bits of mask are set in v
+    Value *hasAll(Value *v, uint32_t mask) {
+        return builder_.CreateICmpEQ(builder_.CreateAnd(v, mask), builder_.getInt32(mask));
+    }
+
+public:
+    CPULevelBuilder(Module &m)
+        : m_(m), builder_(m.getContext()), int32_ty_(Type::getInt32Ty(m.getContext())),
+          regs_ty_(StructType::get(int32_ty_, int32_ty_, int32_ty_, int32_ty_)) {}
+
+    Function *build() {
+        LLVMContext &ctx = m_.getContext();
+        auto *level_var = new GlobalVariable(m_, int32_ty_, /*isConstant*/false, GlobalValue::InternalLinkage,
+                                             builder_.getInt32(-1), "calc.cpu_level.value");
+        Function *fn = Function::Create(FunctionType::get(int32_ty_, false), GlobalValue::InternalLinkage,
+                                        "calc.cpu_level", m_);
+        fn->setDoesNotThrow();
+        BasicBlock *entry_bb = BasicBlock::Create(ctx, "entry", fn);
+        BasicBlock *compute_bb = BasicBlock::Create(ctx, "compute", fn);
+        BasicBlock *avx_bb = BasicBlock::Create(ctx, "avx", fn);
+        BasicBlock *leaf7_bb = BasicBlock::Create(ctx, "leaf7", fn);
+        BasicBlock *done_bb = BasicBlock::Create(ctx, "done", fn);
+
+        builder_.SetInsertPoint(entry_bb);
+        Value *cached = builder_.CreateLoad(int32_ty_, level_var);
+        builder_.CreateCondBr(builder_.CreateICmpSGE(cached, builder_.getInt32(0)), done_bb, compute_bb);
+
+        // leaf 1: AVX, and the OS uses XSAVE, so xgetbv can be asked
+        //     ecx: FMA 12, MOVBE 22, OSXSAVE 27, AVX 28, F16C 29
+        builder_.SetInsertPoint(compute_bb);
+        Value *max_leaf = builder_.CreateExtractValue(cpuid(0, 0), 0);
+        Value *ecx1 = builder_.CreateExtractValue(cpuid(1, 0), 2);
+        uint32_t v3_ecx1 = (1u << 12) | (1u << 22) | (1u << 27) | (1u << 28) | (1u << 29);
+        builder_.CreateCondBr(builder_.CreateAnd(hasAll(ecx1, v3_ecx1),
+                                                 builder_.CreateICmpUGE(max_leaf, builder_.getInt32(7))),
+                              avx_bb, done_bb);
+
+        // XCR0: SSE 1 and AVX 2 for the 256-bit registers, opmask 5, ZMM 6 and 7 for AVX-512
+        builder_.SetInsertPoint(avx_bb);
+        Value *xcr0 = xgetbv();
+        builder_.CreateCondBr(hasAll(xcr0, 0x6), leaf7_bb, done_bb);
+
+        // leaf 7: ebx: BMI1 3, AVX2 5, BMI2 8, AVX512F 16, AVX512DQ 17, AVX512CD 28, AVX512BW 30, AVX512VL 31
+        //     and LZCNT, bit 5 of ecx of leaf 0x80000001
+        builder_.SetInsertPoint(leaf7_bb);
+        Value *ebx7 = builder_.CreateExtractValue(cpuid(7, 0), 1);
+        Value *ecx_ext = builder_.CreateExtractValue(cpuid(0x80000001, 0), 2);
+        Value *v3 = builder_.CreateAnd(hasAll(ebx7, (1u << 3) | (1u << 5) | (1u << 8)), hasAll(ecx_ext, 1u << 5));
+        uint32_t v4_ebx7 = (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+        Value *v4 = builder_.CreateAnd(builder_.CreateAnd(v3, hasAll(ebx7, v4_ebx7)), hasAll(xcr0, 0xe6));
+        Value *level = builder_.CreateSelect(v4, builder_.getInt32(2),
+                                             builder_.CreateZExt(v3, int32_ty_));
+        builder_.CreateBr(done_bb);
+
+        builder_.SetInsertPoint(done_bb);
+        PHINode *res = builder_.CreatePHI(int32_ty_, 4);
+        res->addIncoming(cached, entry_bb);
+        res->addIncoming(builder_.getInt32(0), compute_bb);
+        res->addIncoming(builder_.getInt32(0), avx_bb);
+        res->addIncoming(level, leaf7_bb);
+        // the resolvers run one after the other, so no synchronization is needed
+        builder_.CreateStore(res, level_var);
+        builder_.CreateRet(res);
+        return fn;
+    }
+};
+
+} // namespace
+
+bool MultiVersion::isSupported() {
+    return Triple(sys::getProcessTriple()).getArch() == Triple::x86_64;
+}
+
+void MultiVersion::apply(Module &m, ArrayRef<Function *> fns) {
+    if (fns.empty())
+        return;
+    LLVMContext &ctx = m.getContext();
+    Function *cpu_level = CPULevelBuilder(m).build();
+    IRBuilder<> builder(ctx);
+
+    for (Function *fn : fns) {
+        std::string name = fn->getName().str();
+        // the variants, in the order of Variants
+        Function *versions[array_lengthof(Variants)];
+        for (size_t i = 0; i != array_lengthof(Variants); ++i) {
+            const Variant &v = Variants[i];
+            ValueToValueMapTy vmap;
+            Function *clone = CloneFunction(fn, vmap);
+            clone->setName(name + "." + v.suffix);
+            clone->setLinkage(GlobalValue::InternalLinkage);
+            clone->removeFnAttr("target-features");
+            clone->addFnAttr("target-cpu", v.cpu);
+            if (v.vector_width)
+                clone->addFnAttr("prefer-vector-width", v.vector_width);
+            versions[i] = clone;
+        }
+
+        // fn *name.resolver() { return the best variant for calc.cpu_level() }
+        PointerType *fn_ptr_ty = fn->getType();
+        Function *resolver = Function::Create(FunctionType::get(fn_ptr_ty, false), GlobalValue::InternalLinkage,
+                                              name + ".resolver", m);
+        resolver->setDoesNotThrow();
+        builder.SetInsertPoint(BasicBlock::Create(ctx, "entry", resolver));
+        Value *level = builder.CreateCall(cpu_level);
+        Value *best = versions[array_lengthof(Variants) - 1];
+        for (size_t i = array_lengthof(Variants) - 1; i-- != 0;)
+            best = builder.CreateSelect(builder.CreateICmpUGE(level, builder.getInt32(Variants[i].level)),
+                                        versions[i], best);
+        builder.CreateRet(best);
+
+        // the ifunc takes the place of the function, with its name and visibility
+        fn->setName("");
+        GlobalIFunc *ifunc = GlobalIFunc::create(fn->getFunctionType(), fn->getAddressSpace(), fn->getLinkage(),
+                                                 name, resolver, &m);
+        ifunc->setVisibility(fn->getVisibility());
+        fn->replaceAllUsesWith(ifunc);
+        fn->eraseFromParent();
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+// -multiversion: each kernel is compiled several times, for CPUs of increasing capabilities,
+//     and the best variant for the CPU the program runs on is picked when it is loaded.
+// This gives the full vector width on new CPUs to a binary which still runs on old ones.
+//
+// The variants follow the levels of the x86-64 psABI:
+//     name.sse2    x86-64      the baseline, SSE2
+//     name.avx2    x86-64-v3   AVX2, FMA, BMI1/2, ...
+//     name.avx512  x86-64-v4   AVX-512 F/BW/CD/DQ/VL, vectorized with 512-bit registers
+// The function itself becomes an ifunc, whose resolver asks the CPU with cpuid,
+//     and xgetbv whether the operating system saves the vector registers.
+// The dynamic loader calls the resolver once and binds the symbol to the variant, so a call
+//     to the kernel costs the same as before. The result of cpuid is kept for the other kernels
+//     of the module.
+//
+// The variants are copies of the function made before the optimizer runs,
+//     the "target-cpu" attribute of each one lets the optimizer and the backend tune it for its CPU.
+class MultiVersion {
+public:
+    // true if the host can run multi-versioned code, only x86-64 can
+    static bool isSupported();
+
+    // replaces the functions of the module with ifuncs, before the module is optimized
+    static void apply(llvm::Module &m, llvm::ArrayRef<llvm::Function *> fns);
+};
@@ -0,0 +1,72 @@
+#include "optimizer.h"
+#include "phase_timer.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// With -time-phases, each pass is timed by one handler for the whole process,
+//     so the passes of all modules (the chunks of -f, the batch kernels) add up in one report.
+// It is printed when llvm_shutdown() destroys it, next to the report of the phases.
+// Otherwise the handler is disabled and registers no callbacks; -time-phases is for a single thread.
+static ManagedStatic<TimePassesHandler> TimePasses;
+
+bool Optimizer::run(Module &m, TargetMachine *tm, raw_ostream &diags) {
+    // -O0 without a custom pipeline leaves the IR untouched
+    if (opt_level_ == 0 && passes_.empty())
+        return false;
+    PhaseTimer timer("optimize", "Optimization");
+
+    // The analysis managers must be created in this order,
+    //     and they are destroyed in the reverse order,
+    //     because they hold references to each other after the cross registration.
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+
+    PassInstrumentationCallbacks pic;
+    TimePasses->registerCallbacks(pic);
+
+    PassBuilder pb(tm, PipelineTuningOptions(), None, &pic);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    ModulePassManager mpm;
+    if (!passes_.empty()) {
+        if (Error err = pb.parsePassPipeline(mpm, passes_)) {
+            diags << "calc: " << toString(std::move(err)) << "\n";
+            return true;
+        }
+    }
+    else {
+        OptimizationLevel level = opt_level_ == 1 ? OptimizationLevel::O1 :
+                                  opt_level_ == 2 ? OptimizationLevel::O2 :
+                                                    OptimizationLevel::O3;
+        mpm = pb.buildPerModuleDefaultPipeline(level);
+    }
+    mpm.run(m, mam);
+    return false;
+}
+
+bool Optimizer::checkPipeline(StringRef passes) {
+    if (passes.empty())
+        return false;
+    PassBuilder pb;
+    ModulePassManager mpm;
+    if (Error err = pb.parsePassPipeline(mpm, passes)) {
+        errs() << "calc: " << toString(std::move(err)) << "\n";
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <string>
+
+// Runs the new pass manager over the module built by CodeGen.
+// Either one of the default -O1..-O3 pipelines is used,
+// or a custom pipeline in the textual syntax of opt's -passes option.
+class Optimizer {
+    unsigned opt_level_;
+    std::string passes_;
+
+public:
+    Optimizer(unsigned opt_level, llvm::StringRef passes)
+        : opt_level_(opt_level), passes_(passes.str()) {}
+
+    // The target machine is optional; if given, the passes can query
+    //     target information like the vector width or the cost of instructions.
+    // Returns true if an error occurred, e.g. a malformed pipeline, and prints it to diags.
+    bool run(llvm::Module &m, llvm::TargetMachine *tm, llvm::raw_ostream &diags = llvm::errs());
+
+    // Parses the custom pipeline without running it, so a malformed one is reported once
+    //     before the modules are built, not by each of them.
+    // Returns true and prints the error if it is malformed.
+    static bool checkPipeline(llvm::StringRef passes);
+};
@@ -39,10 +39,12 @@ AST *Parser::parseCalc() {
     }
 
     e = parseExpr();
+    if (!e)
+        return nullptr;
     if (vars.empty()) 
         return e;
     else 
-        return new WithDecl(vars, e);
+        return ctx_.createWithDecl(vars, e);
 
 // Detecting a syntax error is easy but recovering from it is surprisingly complicated
 // a simple approach called panic mode must be used.
@@ -58,66 +60,105 @@ _error:
 }
 
 
-// The other parsing methods are constructed in a similar fashion. 
-// parseExpr() is the translation of the rule for expr
-//     expr : term (( "+" | "-" ) term)* ;
-Expr *Parser::parseExpr() {
-    Expr *left = parseTerm();
-    while (tok_.isOneOf(Token::plus, Token::minus)) {
-        // repeated group inside the rule is translated into a while loop.
-        // note how the use of the isOneOf() method simplifies the check for several tokens.
-        BinaryOp::Operator op = tok_.is(Token::plus) ?
-                                BinaryOp::Plus : BinaryOp::Minus;
-        advance();
-        Expr *right = parseTerm();
-        left = new BinaryOp(op, left, right);
+// The expression rules
+//     expr   : term (( "+" | "-" ) term)* ;
+//     term   : factor (( "*" | "/") factor)* ;
+//     factor : ident | number | "(" expr ")" ;
+// could be translated into one method per rule (a recursive descent parser).
+// But then every level of parentheses costs three nested calls,
+// and machine-generated input with thousands of levels overflows the stack.
+//
+// Instead, parseExpr() is an operator-precedence (shunting-yard) parser:
+//     operands and pending operators are kept on explicit stacks,
+//     and an operator is reduced as soon as an operator with the same or lower precedence follows.
+// The stacks live on the heap, so the nesting depth is only limited by memory,
+// and each token is pushed and popped at most once, so the time is linear.
+
+namespace {
+
+unsigned precedence(Token::TokenKind kind) {
+    switch (kind) {
+        case Token::plus:
+        case Token::minus:
+            return 1;
+        case Token::star:
+        case Token::slash:
+            return 2;
+        default:
+            return 0; // l_paren, never reduced by an operator
     }
-    return left;
 }
 
-
-// term : factor (( "*" | "/") factor)* ;
-Expr *Parser::parseTerm() {
-    Expr *left = parseFactor();
-    while (tok_.isOneOf(Token::star, Token::slash)) {
-        BinaryOp::Operator op = tok_.is(Token::star) ?
-                                BinaryOp::Mul : BinaryOp::Div;
-        advance();
-        Expr *right = parseFactor();
-        left = new BinaryOp(op, left, right);
+BinaryOp::Operator toOperator(Token::TokenKind kind) {
+    switch (kind) {
+        case Token::plus:  return BinaryOp::Plus;
+        case Token::minus: return BinaryOp::Minus;
+        case Token::star:  return BinaryOp::Mul;
+        default:           return BinaryOp::Div;
     }
-    return left;
 }
 
+} // namespace
 
-// factor : ident | number | "(" expr ")" ;
-Expr *Parser::parseFactor() {
-    Expr *res = nullptr;
-    switch (tok_.getKind()) {
-        case Token::number:
-            res = new Factor(Factor::Number, tok_.getText());
-            advance(); break;
-        case Token::ident:
-            res = new Factor(Factor::Ident, tok_.getText());
-            advance(); break;
-        case Token::l_paren:
-            advance(); 
-            res = parseExpr();
-            if (!consume(Token::r_paren)) break;
-        default:
-            if (!res) error();
-            while (!tok_.isOneOf(Token::r_paren, 
-                                 Token::star,
-                                 Token::plus,
-                                 Token::minus,
-                                 Token::slash,
-                                 Token::eoi))
-                advance();
+Expr *Parser::parseExpr() {
+    llvm::SmallVector<Expr *, 32> operands;
+    llvm::SmallVector<Token::TokenKind, 32> ops; // pending operators, l_paren marks an open parenthesis
+
+    // pops the topmost operator and its two operands and pushes the new BinaryOp
+    auto reduce = [&]() {
+        Expr *right = operands.pop_back_val();
+        Expr *left = operands.pop_back_val();
+        operands.push_back(ctx_.getBinaryOp(toOperator(ops.pop_back_val()), left, right));
+    };
+
+    for (;;) {
+        // an operand is expected: a factor, possibly after open parentheses
+        while (tok_.is(Token::l_paren)) {
+            ops.push_back(Token::l_paren);
+            advance();
+        }
+        if (tok_.is(Token::number))
+            operands.push_back(ctx_.getNumber(tok_.getText(), tok_.getValue()));
+        else if (tok_.is(Token::ident))
+            operands.push_back(ctx_.getIdent(tok_.getText()));
+        else
+            goto _error;
+        advance();
+
+        // an operator is expected, closing parentheses are reduced first
+        while (tok_.is(Token::r_paren)) {
+            while (!ops.empty() && ops.back() != Token::l_paren)
+                reduce();
+            // a ")" without a matching "(" ends the expression, the caller reports it
+            if (ops.empty())
+                break;
+            ops.pop_back(); // the l_paren
+            advance();
+        }
+        if (!tok_.isOneOf(Token::plus, Token::minus, Token::star, Token::slash))
+            break;
+        // all operators are left associative
+        while (!ops.empty() && precedence(ops.back()) >= precedence(tok_.getKind()))
+            reduce();
+        ops.push_back(tok_.getKind());
+        advance();
     }
-    return res;
-}
 
+    while (!ops.empty()) {
+        if (ops.back() == Token::l_paren) {
+            // report the missing ")"
+            expect(Token::r_paren);
+            goto _recover;
+        }
+        reduce();
+    }
+    return operands.back();
 
-// As soon as you have memorized the used patterns, 
-// it is almost tedious to code the parser based on the grammar rules. 
-// This type of parser is called a recursive descent parser.
\ No newline at end of file
+_error:
+    error();
+// panic mode, as in parseCalc()
+_recover:
+    while (!tok_.is(Token::eoi))
+        advance();
+    return nullptr;
+}
@@ -8,18 +8,27 @@
 //     so the header of the equivalent LLVM functionality must be included.
 
 class Parser {
-    Lexer &lex_;     // used to retrieve the next token from the input
+    Lexer *lex_;     // used to retrieve the next token from the input
+    const TokenBuffer *tokens_; // or the tokens were lexed in advance
+    size_t pos_;     // the index of the next token in tokens_
+    ASTContext &ctx_; // creates the nodes of the tree
     Token tok_;      // stores the next token (the look-ahead)
     bool has_error_; // indicates if an error was detected
+    llvm::raw_ostream *diag_ = &llvm::errs(); // where the errors are reported
 
     void error() {
-        llvm::errs() << "Unexpected: " << tok_.getText() << "\n";
+        *diag_ << "Unexpected: " << tok_.getText() << "\n";
         has_error_ = true;
     }
 
-    // advance() retrieves the next token from the lexer.expect()
-    // tests whether the look-ahead is of the expected kind and emits an error message if not
-    void advance() { lex_.next(tok_); }
+    // advance() retrieves the next token from the lexer (or the token buffer).
+    // expect() tests whether the look-ahead is of the expected kind and emits an error message if not
+    void advance() {
+        if (tokens_)
+            tokens_->get(pos_++, tok_);
+        else
+            lex_->next(tok_);
+    }
 
     bool expect(Token::TokenKind kind) {
         if (tok_.getKind() != kind ) {
@@ -40,19 +49,27 @@ class Parser {
     }
 
     AST  *parseCalc();
-    Expr *parseExpr();
-    Expr *parseTerm();
-    Expr *parseFactor();
+    Expr *parseExpr(); // also covers the term and factor rules, without recursion
     // There are no methods for ident and number. 
     //     Those rules only return the token and are replaced by the corresponding token.
 
 public:
-    Parser(Lexer &lex): lex_(lex), has_error_(false) {
+    Parser(Lexer &lex, ASTContext &ctx)
+        : lex_(&lex), tokens_(nullptr), pos_(0), ctx_(ctx), has_error_(false) {
         // llvm::outs() << "Parser::Parser\n";
         advance();
     }
 
+    // parses tokens filled in advance by Lexer::tokenize()
+    Parser(const TokenBuffer &tokens, ASTContext &ctx)
+        : lex_(nullptr), tokens_(&tokens), pos_(0), ctx_(ctx), has_error_(false) {
+        advance();
+    }
+
     bool hasError() { return has_error_; }
+    // the errors go to llvm::errs() unless another stream is set,
+    //     e.g. to keep the messages of different threads apart
+    void setDiagnostics(llvm::raw_ostream &os) { diag_ = &os; }
 
     // the parse() method is the main entry point into parsing
     AST *parse();
@@ -0,0 +1,36 @@
+#include "phase_timer.h"
+#include "llvm/Pass.h"
+
+using namespace llvm;
+
+// Every event is recorded, however short:
+//     the phases of a small expression take microseconds, not the milliseconds of a C++ file.
+static const unsigned TraceGranularity = 0;
+
+bool PhaseTimer::timers_enabled_ = false;
+
+void PhaseTimer::enableTimers() {
+    timers_enabled_ = true;
+    // the pass managers time each pass (see Optimizer::run() and the legacy pass manager)
+    TimePassesIsEnabled = true;
+}
+
+void PhaseTimer::startTrace() {
+    timeTraceProfilerInitialize(TraceGranularity, "calc");
+}
+
+Error PhaseTimer::writeTrace(StringRef file_name) {
+    Error err = timeTraceProfilerWrite(file_name, "calc");
+    timeTraceProfilerCleanup();
+    return err;
+}
+
+TraceThread::TraceThread(bool enabled) : enabled_(enabled) {
+    if (enabled_)
+        timeTraceProfilerInitialize(TraceGranularity, "calc");
+}
+
+TraceThread::~TraceThread() {
+    if (enabled_)
+        timeTraceProfilerFinishThread();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "mem_stats.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+
+// Measures one phase of the compiler (parsing, optimization, ...) for -time-phases, -time-trace
+//     and -mem-stats.
+//
+// With -time-phases, each phase is a timer of the TimerGroup "calc",
+//     the report is printed to stderr when calc exits (by llvm_shutdown(), see InitLLVM).
+//     The passes of the optimizer and of the backend are timed as well, like with -time-passes.
+// With -time-trace, each phase is an event of the Chrome trace written at the end (see writeTrace()),
+//     and the pass managers add an event for every pass on their own.
+//
+// With -mem-stats, each phase also counts the allocations of its thread (see MemStats).
+//
+// When none of them is enabled, a PhaseTimer only tests three flags, so the phases can be instrumented
+//     unconditionally. The timers are not thread safe: -time-phases is for a single thread,
+//     the trace records each thread which called TraceThread separately.
+class PhaseTimer {
+    llvm::Optional<llvm::NamedRegionTimer> timer_;
+    llvm::Optional<llvm::TimeTraceScope> trace_;
+    // with MemStats enabled, the counters of the thread when the phase started
+    llvm::StringRef name_, description_;
+    bool count_memory_ = false;
+    uint64_t allocations_ = 0, bytes_ = 0;
+
+    static bool timers_enabled_;
+
+public:
+    // name identifies the timer, description is shown in the report and in the trace
+    PhaseTimer(llvm::StringRef name, llvm::StringRef description) {
+        if (timers_enabled_)
+            timer_.emplace(name, description, "calc", "calc phases");
+        if (llvm::timeTraceProfilerEnabled())
+            trace_.emplace(description);
+        // last, so the allocations of the timers are not counted
+        if (MemStats::isEnabled()) {
+            name_ = name;
+            description_ = description;
+            count_memory_ = true;
+            allocations_ = MemStats::threadAllocations();
+            bytes_ = MemStats::threadAllocatedBytes();
+        }
+    }
+
+    ~PhaseTimer() {
+        if (count_memory_)
+            MemStats::addPhase(name_, description_, MemStats::threadAllocations() - allocations_,
+                               MemStats::threadAllocatedBytes() - bytes_);
+    }
+
+    // -time-phases, before the first phase starts
+    static void enableTimers();
+    static bool timersEnabled() { return timers_enabled_; }
+
+    // -time-trace: starts recording the trace of the current thread
+    static void startTrace();
+    // writes the trace as Chrome trace JSON (chrome://tracing, Perfetto) and stops recording
+    static llvm::Error writeTrace(llvm::StringRef file_name);
+};
+
+// Records the trace events of a worker thread while it exists, if the trace is enabled.
+// The events are merged into the trace when it is written, with the ID of the thread.
+class TraceThread {
+    bool enabled_;
+
+public:
+    explicit TraceThread(bool enabled);
+    ~TraceThread();
+};
@@ -1,67 +1,69 @@
 #include "sema.h"
-#include "llvm/ADT/StringSet.h"
+#include "mem_stats.h"
+#include "llvm/ADT/BitVector.h"
 #include "llvm/Support/raw_ostream.h"
 
-// The basic idea is that the name of each declared variable is stored in a set. 
+// The basic idea is that each declared variable is stored in a set. 
 // While the set it being created, we can check that each name is unique 
-// and then check that the name is in the set later:
+// and then check that the name is in the set later.
+// The names already have dense IDs from the symbol table (see ASTContext),
+//     so the set is a bit vector indexed by the ID, and no string is hashed here:
 
 namespace {
 
-class DeclCheck : public ASTVisitor {
-    llvm::StringSet<> scope_; // A set-like wrapper for the StringMap.
+class DeclCheck : public ASTVisitorBase<DeclCheck> {
+    llvm::BitVector scope_; // bit i is set if the variable with the ID i is declared
     bool has_error_;
+    llvm::raw_ostream &diag_;
 
     enum ErrorType { Twice, Not };
 
     void error(ErrorType et, llvm::StringRef v) {
-        llvm::errs() << "Variable '" << v << "' "
+        diag_ << "Variable '" << v << "' "
                      << (et == Twice ? "already" : "not")
                      << " declared\n";
         has_error_ = true;
     }
 
 public:
-    DeclCheck() : has_error_(false) {}
+    DeclCheck(llvm::raw_ostream &diag) : has_error_(false), diag_(diag) {}
     bool hasError() { return has_error_; }
+    // the memory of the scope, for MemStats
+    size_t getScopeBytes() const { return scope_.getMemorySize(); }
     
     // In a Factor node that holds a variable name, we check that the variable name is in the set
-    virtual void visit(Factor &node) override {
+    void visit(Factor &node) {
         // llvm::outs() << "DeclCheck::Factor\n";
         if (node.getKind() == Factor::Ident) {
             // llvm::outs() << " value = " << node.getVal() << "\n";
-            if (scope_.find(node.getVal()) == scope_.end())
+            uint32_t symbol = node.getSymbol();
+            if (symbol >= scope_.size() || !scope_.test(symbol))
                 error(Not, node.getVal());
         }
     }
 
-    // For a BinaryOp node, we only need to check that both sides exist and have been visited
-    virtual void visit(BinaryOp &node) override {
+    // For a BinaryOp node, we only need to check that both sides exist
+    // The walk visits the operands before the node (see ASTVisitorBase::walkPostOrder)
+    void visit(BinaryOp &node) {
         // llvm::outs() << "DeclCheck::BinaryOp\n";
-        if (node.getLeft())
-            node.getLeft()->accept(*this);
-        else
-            has_error_ = true;
-        
-        if (node.getRight())
-            node.getRight()->accept(*this);
-        else
+        if (!node.getLeft() || !node.getRight())
             has_error_ = true;
     }
 
     // In a WithDecl node, the set is populated and the walk over the expression is started
-    virtual void visit(WithDecl &node) override {
+    void visit(WithDecl &node) {
         // llvm::outs() << "DeclCheck::WithDecl\n";
-        for (auto i = node.begin(), e = node.end(); i != e; ++i) {
-            // llvm::outs() << "    " << *i << "\n";
-            if (scope_.insert(*i).second == false)
-                error(Twice, *i);
-            /// insert - Insert the specified key/value pair into the map.  
-            /// If the key already exists in the map, return false and ignore the request, 
-            /// otherwise insert it and return true.
+        llvm::ArrayRef<uint32_t> symbols = node.getSymbols();
+        for (size_t i = 0, e = symbols.size(); i != e; ++i) {
+            // llvm::outs() << "    " << node.getVars()[i] << "\n";
+            if (symbols[i] >= scope_.size())
+                scope_.resize(symbols[i] + 1);
+            if (scope_.test(symbols[i]))
+                error(Twice, node.getVars()[i]);
+            scope_.set(symbols[i]);
         }
         if (node.getExpr())
-            node.getExpr()->accept(*this);
+            walkPostOrder(node.getExpr());
         else
             has_error_ = true;
     }
@@ -77,7 +79,8 @@ bool Sema::semantic(AST *tree) {
     if (!tree)
         return false;
 
-    DeclCheck check;
-    tree->accept(check);
+    DeclCheck check(diag_);
+    check.traverse(*tree);
+    MemStats::noteArena("sema scope", check.getScopeBytes());
     return check.hasError();
 }
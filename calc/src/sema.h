@@ -2,10 +2,13 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include "llvm/Support/raw_ostream.h"
 
 class Sema {
+    llvm::raw_ostream &diag_; // where the errors are reported
 
 public:
+    Sema(llvm::raw_ostream &diag = llvm::errs()) : diag_(diag) {}
     bool semantic(AST *tree);
 
 };
@@ -0,0 +1,344 @@
+#include "server.h"
+#include "const_fold.h"
+#include "parser.h"
+#include "sema.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace llvm;
+
+namespace {
+
+// the largest payload accepted, a longer frame is a protocol error
+const size_t MaxFrameSize = 64 << 20;
+
+// Reads frames from a file descriptor through a buffer,
+//     so a client which sends many small requests at once costs few read() calls.
+class FrameReader {
+    int fd_;
+    char buf_[64 << 10];
+    size_t pos_ = 0, end_ = 0;
+
+    bool fill() {
+        for (;;) {
+            ssize_t n = ::read(fd_, buf_, sizeof(buf_));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            pos_ = 0;
+            end_ = size_t(n);
+            return true;
+        }
+    }
+
+public:
+    FrameReader(int fd) : fd_(fd) {}
+
+    // returns false at the end of the input or if the frame is malformed
+    bool read(std::string &payload) {
+        size_t len = 0, digits = 0;
+        for (;;) {
+            if (pos_ == end_ && !fill())
+                return false;
+            char c = buf_[pos_++];
+            if (c == '\n' && digits != 0)
+                break;
+            if (c < '0' || c > '9' || (len = len * 10 + (c - '0')) > MaxFrameSize)
+                return false;
+            ++digits;
+        }
+        payload.clear();
+        while (payload.size() < len) {
+            if (pos_ == end_ && !fill())
+                return false;
+            size_t n = std::min(len - payload.size(), end_ - pos_);
+            payload.append(buf_ + pos_, n);
+            pos_ += n;
+        }
+        return true;
+    }
+};
+
+bool writeAll(int fd, StringRef data) {
+    while (!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = data.drop_front(size_t(n));
+    }
+    return true;
+}
+
+bool writeFrame(int fd, StringRef payload) {
+    std::string frame = (Twine(payload.size()) + "\n" + payload).str();
+    return writeAll(fd, frame);
+}
+
+// the messages of Parser and Sema are one per line, the response has them on one line
+std::string oneLine(StringRef text) {
+    SmallVector<StringRef, 4> lines;
+    text.trim().split(lines, '\n', -1, /*KeepEmpty*/false);
+    std::string res;
+    for (StringRef l : lines) {
+        if (!res.empty())
+            res += "; ";
+        res += l.trim().str();
+    }
+    return res;
+}
+
+} // namespace
+
+CalcServer::Entry::~Entry() {
+    if (!tracker)
+        return;
+    if (Error err = tracker->remove())
+        logAllUnhandledErrors(std::move(err), errs(), "calc: ");
+}
+
+CalcServer::CalcServer(std::unique_ptr<CalcJIT> jit, std::unique_ptr<ExprCache> cache, unsigned opt_level,
+                       uint64_t jit_threshold, size_t max_exprs)
+    : jit_(std::move(jit)), cache_(std::move(cache)), opt_level_(opt_level), jit_threshold_(jit_threshold),
+      max_exprs_(std::max<size_t>(max_exprs, 1)), promoter_(hardware_concurrency(1)) {
+    config_ = ("server -O" + Twine(opt_level) + " " + ExprCache::describeTarget(jit_->getTargetMachine())).str();
+}
+
+Expected<std::unique_ptr<CalcServer>> CalcServer::create(unsigned opt_level, StringRef cache_dir,
+                                                         uint64_t max_cache_bytes, uint64_t jit_threshold,
+                                                         size_t max_exprs) {
+    auto cache = std::make_unique<ExprCache>(cache_dir, max_cache_bytes);
+    auto jit = CalcJIT::create(opt_level, cache.get());
+    if (!jit)
+        return jit.takeError();
+    return std::unique_ptr<CalcServer>(
+        new CalcServer(std::move(*jit), std::move(cache), opt_level, jit_threshold, max_exprs));
+}
+
+std::shared_ptr<CalcServer::Entry> CalcServer::compile(StringRef expr) {
+    auto entry = std::make_shared<Entry>();
+    raw_string_ostream diags(entry->error);
+
+    // the front end runs for every request, it is cheap compared to the rest of the pipeline
+    ASTContext ast_ctx;
+    Lexer lex(expr);
+    Parser parser(lex, ast_ctx);
+    parser.setDiagnostics(diags);
+    AST *tree = parser.parse();
+    if (!tree || parser.hasError()) {
+        diags << "syntax errors occured";
+        diags.flush();
+        return entry;
+    }
+    if (Sema(diags).semantic(tree)) {
+        diags << "semantic errors occured";
+        diags.flush();
+        return entry;
+    }
+    tree = ConstFold(ast_ctx).fold(tree);
+    entry->key = ExprCache::computeKey(tree, config_);
+
+    std::promise<void> translated;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = entries_.find(entry->key);
+        if (it != entries_.end()) {
+            std::shared_ptr<Entry> found = it->second;
+            lru_.splice(lru_.begin(), lru_, found->lru);
+            lock.unlock();
+            found->translated.wait();
+            return found;
+        }
+        entry->translated = translated.get_future().share();
+        entry->lru = lru_.insert(lru_.begin(), entry.get());
+        entries_[entry->key] = entry;
+        evict();
+    }
+
+    entry->text = expr.str();
+    if (auto *decl = dyn_cast<WithDecl>(tree))
+        entry->num_vars = decl->getVars().size();
+    if (jit_threshold_)
+        entry->bytecode = Bytecode::compile(tree);
+    if (!entry->bytecode) {
+        Compiled res = build(tree, entry->key);
+        entry->error = std::move(res.error);
+        entry->tracker = std::move(res.tracker);
+        entry->native.store(res.fn, std::memory_order_release);
+    }
+    // the requests waiting for the entry see the error, the next request for the expression tries again
+    if (!entry->error.empty()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lru_.erase(entry->lru);
+        entries_.erase(entry->key);
+    }
+    translated.set_value();
+    return entry;
+}
+
+void CalcServer::evict() {
+    // An entry which is held by a request or by the promoter is skipped,
+    //     the table may exceed the limit for as long as they hold them.
+    auto it = lru_.end();
+    while (entries_.size() > max_exprs_ && it != lru_.begin()) {
+        Entry *e = *--it;
+        auto found = entries_.find(e->key);
+        if (found->second.use_count() != 1)
+            continue;
+        // The code is removed before the key leaves the table:
+        //     a request which comes for the expression right after defines calc_expr_<key> again.
+        if (e->tracker) {
+            if (Error err = e->tracker->remove())
+                logAllUnhandledErrors(std::move(err), errs(), "calc: ");
+            e->tracker = nullptr;
+        }
+        entries_.erase(found);
+        it = lru_.erase(it);
+    }
+}
+
+void CalcServer::promote(std::shared_ptr<Entry> entry) {
+    promoter_.async([this, entry] {
+        // The expression was checked when it was first seen, so it is only parsed and folded again.
+        // The tree is the same as then, and so is the key.
+        ASTContext ast_ctx;
+        Lexer lex(entry->text);
+        Parser parser(lex, ast_ctx);
+        parser.setDiagnostics(nulls());
+        AST *tree = parser.parse();
+        if (!tree || parser.hasError())
+            return;
+        tree = ConstFold(ast_ctx).fold(tree);
+        // if the compilation fails, the expression just stays in the interpreter
+        Compiled res = build(tree, entry->key);
+        if (res.fn) {
+            entry->tracker = std::move(res.tracker);
+            entry->native.store(res.fn, std::memory_order_release);
+        }
+    });
+}
+
+CalcServer::Compiled CalcServer::build(AST *tree, StringRef key) {
+    Compiled res;
+    if (auto *decl = dyn_cast<WithDecl>(tree))
+        res.num_vars = decl->getVars().size();
+    std::string name = ("calc_expr_" + key).str();
+    orc::ResourceTrackerSP tracker = jit_->createTracker();
+
+    // an object from an earlier run of the server, or the IR is generated and compiled
+    auto add = [&]() -> Expected<JITTargetAddress> {
+        if (std::unique_ptr<MemoryBuffer> obj = cache_->lookup(key)) {
+            if (Error err = jit_->addObject(std::move(obj), tracker))
+                return err;
+            return jit_->lookup(name);
+        }
+        return jit_->addFunction(tree, name, opt_level_, tracker, key);
+    };
+    Expected<JITTargetAddress> addr = add();
+    if (!addr) {
+        res.error = toString(addr.takeError());
+        // what was added before the error goes away with the tracker
+        if (Error err = tracker->remove())
+            logAllUnhandledErrors(std::move(err), errs(), "calc: ");
+        return res;
+    }
+    res.fn = jitTargetAddressToFunction<ExprFn>(*addr);
+    res.tracker = std::move(tracker);
+    return res;
+}
+
+std::string CalcServer::handle(StringRef request) {
+    StringRef command, expr;
+    std::tie(command, expr) = request.split('\n');
+    SmallVector<StringRef, 8> args;
+    command.split(args, ' ', -1, /*KeepEmpty*/false);
+    if (args.empty() || (args[0] != "eval" && args[0] != "compile"))
+        return "error unknown command";
+    bool eval = args[0] == "eval";
+
+    SmallVector<int32_t, 8> vars;
+    for (StringRef arg : makeArrayRef(args).drop_front()) {
+        int32_t v;
+        if (!eval || arg.getAsInteger(10, v))
+            return ("error invalid value '" + arg + "'").str();
+        vars.push_back(v);
+    }
+
+    std::shared_ptr<Entry> e = compile(expr);
+    if (!e->error.empty())
+        return "error " + oneLine(e->error);
+    if (!eval)
+        return ("ok " + Twine(e->num_vars)).str();
+    if (vars.size() != e->num_vars)
+        return ("error expected " + Twine(e->num_vars) + " values, got " + Twine(vars.size())).str();
+
+    if (ExprFn fn = e->native.load(std::memory_order_acquire))
+        return ("ok " + Twine(fn(vars.data()))).str();
+    // only the request which reaches the threshold promotes the expression
+    if (e->evals.fetch_add(1, std::memory_order_relaxed) + 1 == jit_threshold_)
+        promote(e);
+    return ("ok " + Twine(e->bytecode->run(vars.data()))).str();
+}
+
+bool CalcServer::serveStream(int in_fd, int out_fd) {
+    FrameReader reader(in_fd);
+    std::string request;
+    while (reader.read(request)) {
+        if (!writeFrame(out_fd, handle(request)))
+            return true;
+    }
+    return false;
+}
+
+bool CalcServer::serveSocket(StringRef path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errs() << "calc: the socket path is too long: " << path << "\n";
+        return true;
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        errs() << "calc: can't create a socket: " << std::strerror(errno) << "\n";
+        return true;
+    }
+    // a socket file left behind by an earlier server is replaced
+    ::unlink(addr.sun_path);
+    if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd, 128) != 0) {
+        errs() << "calc: can't listen on " << path << ": " << std::strerror(errno) << "\n";
+        ::close(listen_fd);
+        return true;
+    }
+    // a client which goes away must not take the server with it
+    std::signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            errs() << "calc: accept failed: " << std::strerror(errno) << "\n";
+            ::close(listen_fd);
+            return true;
+        }
+        std::thread([this, fd] {
+            serveStream(fd, fd);
+            ::close(fd);
+        }).detach();
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "bytecode.h"
+#include "expr_cache.h"
+#include "jit.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// A long-lived calc process which compiles and evaluates expressions on request.
+// The targets are initialized and the JIT is created once,
+//     so a request only pays for parsing and, the first time an expression is seen, compiling it.
+//
+// The requests and responses are frames: the length of the payload in decimal, a newline,
+//     and the payload itself, so an expression may contain newlines.
+//
+//     request  "eval 3 4\nwith a,b: a*b"   evaluates the expression with a=3 and b=4
+//              "compile\nwith a,b: a*b"   only compiles it, e.g. to warm up the server
+//     response "ok 12"                     the result (for compile: the number of variables)
+//              "error <message>"
+//
+// The execution is tiered: a new expression is first translated to Bytecode and interpreted,
+//     which costs microseconds instead of the milliseconds of the optimizer and the JIT.
+// Once an expression has been evaluated jit_threshold times, it is compiled on a background thread.
+// The requests keep using the interpreter until the native code is ready,
+//     then its address is swapped in and the following requests call it directly.
+// With a threshold of 0, each expression is compiled the first time it is seen.
+//
+// A compiled expression is the function
+//     int32_t calc_expr_<key>(const int32_t *vars)
+// where key is the key of the expression in the ExprCache (see ExprCache::computeKey()).
+// Both tiers compute with wrap-around and division doesn't trap (x/0 is 0),
+//     so no request can bring the server down and the result doesn't depend on the tier.
+// The server keeps at most max_exprs expressions, the one used least recently goes first
+//     and the code of its native tier is removed from the JIT.
+// With a cache directory, the objects survive the eviction and a restart of the server,
+//     an evicted expression which comes back is only linked again.
+// An expression which doesn't compile is not kept, so the next request for it tries again.
+class CalcServer {
+    std::unique_ptr<CalcJIT> jit_;
+    std::unique_ptr<ExprCache> cache_;
+    std::string config_; // the part of the cache key besides the tree
+    unsigned opt_level_;
+    uint64_t jit_threshold_;
+    size_t max_exprs_;
+
+    using ExprFn = int32_t (*)(const int32_t *);
+    struct Compiled {
+        ExprFn fn = nullptr;
+        size_t num_vars = 0;
+        std::string error; // set if the expression can't be compiled
+        llvm::orc::ResourceTrackerSP tracker; // owns the code of fn
+    };
+    // an expression as it is kept between the requests
+    struct Entry {
+        std::string key;
+        std::string text; // the expression is parsed again when it is promoted
+        size_t num_vars = 0;
+        std::string error; // set if the expression can't be compiled
+        // nullptr if the expression is too large for the interpreter, then it's compiled right away
+        std::unique_ptr<Bytecode> bytecode;
+        // set once the expression has been compiled to native code
+        std::atomic<ExprFn> native{nullptr};
+        std::atomic<uint64_t> evals{0};
+        // the code of native, it goes with the entry
+        llvm::orc::ResourceTrackerSP tracker;
+        // ready once the expression is translated
+        std::shared_future<void> translated;
+        // where the entry is in lru_
+        std::list<Entry *>::iterator lru;
+
+        ~Entry();
+    };
+    // The expressions by key.
+    // An entry is put here before the expression is translated,
+    //     so concurrent requests for the same expression wait for one translation.
+    // A request holds the entry while it evaluates it, an entry is only evicted when no one holds it,
+    //     so the code of a function is not removed while it runs.
+    llvm::StringMap<std::shared_ptr<Entry>> entries_;
+    // the entries, the one used most recently first
+    std::list<Entry *> lru_;
+    std::mutex mutex_;
+    // Compiles the hot expressions in the background.
+    // It is declared last, so it is destroyed first: the pending compilations finish
+    //     while the JIT and the cache are still there.
+    llvm::ThreadPool promoter_;
+
+    CalcServer(std::unique_ptr<CalcJIT> jit, std::unique_ptr<ExprCache> cache, unsigned opt_level,
+               uint64_t jit_threshold, size_t max_exprs);
+
+    std::shared_ptr<Entry> compile(llvm::StringRef expr);
+    // removes the entries beyond max_exprs_ and their code, with mutex_ held
+    void evict();
+    Compiled build(AST *tree, llvm::StringRef key);
+    void promote(std::shared_ptr<Entry> entry);
+
+public:
+    // cache_dir may be empty, then the objects are only kept in memory
+    static llvm::Expected<std::unique_ptr<CalcServer>> create(unsigned opt_level, llvm::StringRef cache_dir,
+                                                              uint64_t max_cache_bytes,
+                                                              uint64_t jit_threshold = 1000,
+                                                              size_t max_exprs = 10000);
+
+    // handles the payload of one request and returns the payload of the response
+    // It may be called from several threads at once.
+    std::string handle(llvm::StringRef request);
+
+    // Serves the requests read from in_fd until the end of the input, the responses go to out_fd.
+    // The client may send more requests before it reads the responses, they are answered in order.
+    // Returns true if an I/O error occurred.
+    bool serveStream(int in_fd, int out_fd);
+
+    // Accepts clients on a Unix domain socket, each one is served on a thread of its own.
+    // Returns only if the socket can't be set up.
+    bool serveSocket(llvm::StringRef path);
+
+    ExprCache &getCache() { return *cache_; }
+
+    // waits until the expressions which are being promoted are compiled
+    void waitForPromotions() { promoter_.wait(); }
+};
@@ -0,0 +1,42 @@
+#include "target_cpu.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Host.h"
+#include <vector>
+
+using namespace llvm;
+
+TargetCPU TargetCPU::get(StringRef cpu, StringRef attrs) {
+    TargetCPU target;
+    if (cpu == "native") {
+        target.cpu = sys::getHostCPUName().str();
+        // the features the CPU actually has, e.g. a model which is sold with AVX-512 disabled
+        StringMap<bool> host_features;
+        if (sys::getHostCPUFeatures(host_features)) {
+            // sorted, so the string is the same each time, e.g. in the key of the cache
+            std::vector<std::string> list;
+            for (const auto &f : host_features)
+                list.push_back((f.getValue() ? "+" : "-") + f.getKey().str());
+            llvm::sort(list);
+            target.features = join(list, ",");
+        }
+    } else if (!cpu.empty()) {
+        target.cpu = cpu.str();
+    }
+    // the features of -mattr come last, so they override those of the host
+    if (!attrs.empty()) {
+        if (!target.features.empty())
+            target.features += ",";
+        target.features += attrs.str();
+    }
+    return target;
+}
+
+void TargetCPU::apply(Function &fn) const {
+    if (isGeneric())
+        return;
+    fn.addFnAttr("target-cpu", cpu);
+    if (!features.empty())
+        fn.addFnAttr("target-features", features);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include <string>
+
+// The CPU the code is tuned for, selected with -mcpu and -mattr like in clang and llc.
+// The default, "generic", runs on every CPU of the host's architecture.
+// With -mcpu=native, the code uses everything the CPU calc runs on has to offer,
+//     so it may not run on an older one.
+//
+// The target machine of ObjectEmitter generates the code for it, and CodeGen puts it on each function
+//     as the attributes "target-cpu" and "target-features", so the optimizer sees it as well:
+//     the vectorizer picks its vector width from them.
+struct TargetCPU {
+    std::string cpu = "generic";
+    std::string features; // "+avx2,-fma", in the syntax of -mattr
+
+    // resolves "native" to the host CPU and its features, attrs are added to the features
+    static TargetCPU get(llvm::StringRef cpu, llvm::StringRef attrs);
+
+    bool isGeneric() const { return cpu == "generic" && features.empty(); }
+
+    // sets the attributes of the function, the generic CPU sets none
+    void apply(llvm::Function &fn) const;
+};